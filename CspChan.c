@@ -14,6 +14,7 @@
 * file, You can obtain one at https://mozilla.org/MPL/2.0/.
 */
 
+#define _GNU_SOURCE /* MAP_HUGETLB, MADV_HUGEPAGE, usleep */
 #include "CspChan.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -22,48 +23,369 @@
 #include <error.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* TODO: Win32 implementation */
 
-enum { SignalsCount = 3 };
+enum { HugePageSize = 2 * 1024 * 1024 };
+enum { LazyInitialBytes = 256, LazyIdleMs = 1000 };
+enum { CopyAny, Copy1, Copy2, Copy4, Copy8, Copy16, CopyLarge };
+enum { NonTemporalBytes = 4 * 1024 }; /* minimum message size for CspChan_NonTemporal */
 
-typedef struct Signals
+/* The context of the waiter records of a blocking select */
+typedef struct Observer
 {
-    pthread_cond_t* sig[SignalsCount];
-    struct Signals* next;
-} Signals;
+    pthread_cond_t* sig;
+    pthread_mutex_t* mtx; /* the mutex the observer holds while checking and waiting for sig */
+} Observer;
 
-typedef struct CspChan_t
+/* The synchronization part of a channel; it makes up most of the size of a channel. Normal channels
+   carry it with them, compact channels only allocate it when a thread has to wait for the first time. */
+typedef struct Waiters
 {
     pthread_mutex_t srMtx, observerMtx;
     pthread_cond_t condA; /* received | waiting for second thread */
     pthread_cond_t condB; /* sent | waiting for channel free */
+    unsigned int waiting; /* number of threads in wait_until */
+    unsigned short coalesceMin; /* see CspChan_coalesce */
+    unsigned int coalesceMs;
+    CspChan_Stats* counters; /* allocated with the first event counted; see CspChan_stats */
+    void* index; /* KeyedOrder: Keys, PriorityOrder and DelayOrder: Heap */
+    struct Codel* aqm; /* see CspChan_aqm */
+    struct Tuning* tune; /* see CspChan_autotune */
+    CspChan_Waiter observer; /* list head of the waiter records of select statements */
+} Waiters;
+
+enum { CondA, CondB };
+
+enum { NotFused, FusedSend, FusedReceive };
+enum { FullBlock, FullOverwrite, FullDrop, FullConflate }; /* what a send does if the channel is full */
+enum { RingOrder, KeyedOrder, PriorityOrder, DelayOrder }; /* the order in which the messages of a buffered channel are received */
+enum { HeapArity = 4 }; /* a 4-ary heap is flatter than a binary one, and the children of a node share a cache line */
+enum { TuneWindow = 256 }; /* the number of messages sent between two decisions of CspChan_autotune */
+enum { StallCheckMs = 10 }; /* how long a suspected stall has to persist to be resolved */
+enum { SimSliceMs = 1 }; /* the real time all agents must be blocked before the simulated clock advances */
+enum { MinShards = 4 };
+enum { FusionLocalBytes = 256 }; /* messages up to this size are transformed on the stack */
+
+/* A sharded channel consists of buffered channels (shards), one per CPU; a sender always uses the same
+   shard, and receivers scan all shards round-robin. */
+typedef struct Shards
+{
+    unsigned int count;
+    unsigned int next; /* the shard the next receive starts with */
+    CspChan_t** shard;
+    CspChan_Waiter* forward; /* one per shard; forwards the notifications of the shard to the channel */
+} Shards;
+
+/* The key index of a keyed channel; the ring buffer itself keeps the messages in the order their keys
+   became pending, and a newer message with a pending key replaces the older one in its slot. */
+typedef struct Keys
+{
+    unsigned int keyLen;
+    unsigned int mask; /* the number of entries - 1, a power of two >= 2 * queueLen */
+    unsigned short* entry; /* open addressing with linear probing; 1 + the ring index of a message, or 0 */
+} Keys;
+
+/* The heap of a priority or delay channel; the messages stay in their ring slots, and only the slot numbers are
+   moved in the heap. */
+typedef struct Heap
+{
+    unsigned int next; /* the sequence number of the next message sent */
+    long long* rank; /* per slot; the message with the lowest rank is received first; the due time for DelayOrder */
+    unsigned int* seq; /* per slot; messages of equal rank are received in the order they were sent */
+    unsigned short* node; /* the slots of the msgCount messages in heap order */
+    unsigned short* unused; /* a stack of the queueLen - msgCount unused slots */
+} Heap;
+
+/* The state of the CoDel queue management (see CspChan_aqm); the times are microseconds which wrap around */
+typedef struct Codel
+{
+    unsigned int target, interval;
+    CspChan_t* divert;
+    unsigned int firstAbove; /* when the delay will have been above target for an interval, or 0 */
+    unsigned int dropNext; /* when the next message is shed while dropping */
+    unsigned int count, lastCount; /* the messages shed in the current and previous dropping state */
+    int dropping;
+    unsigned int* enqueued; /* per ring slot; when the message was sent */
+} Codel;
+
+/* The state of CspChan_autotune */
+typedef struct Tuning
+{
+    unsigned short minLen, maxLen;
+    unsigned int target; /* permille of the sends which may block */
+    unsigned int sends; /* in the current window */
+    unsigned long blockedAtStart; /* stats.blockedSends at the start of the current window */
+    unsigned long starvedAtStart; /* stats.blockedReceives at the start of the current window */
+    unsigned short peak; /* the maximum msgCount in the current window */
+} Tuning;
+
+typedef struct Fusion
+{
+    CspChan_Transform fn;
+    void* ctx;
+    struct CspChan_t* other; /* the downstream (FusedSend) or upstream (FusedReceive) channel */
+} Fusion;
+
+typedef struct CspChan_t
+{
+    volatile unsigned char lock; /* compact channels use this spin lock instead of w->srMtx */
     unsigned short msgLen;
     unsigned short closed : 1;
     unsigned short unbuffered : 1;
     unsigned short barrierPhase : 2;
     unsigned short expectingSender : 1;
+    unsigned short mapped : 1; /* data points to an mmapped ring, not to the inline storage */
+    unsigned short huge : 1; /* the mapping uses MAP_HUGETLB pages */
+    unsigned short mirrored : 1; /* the mapping of cap slots is followed by a second mapping of the same memory */
+    unsigned short compact : 1;
+    unsigned short heap : 1; /* data was allocated separately by malloc */
+    unsigned short lazy : 1; /* cap follows the number of buffered messages */
+    unsigned short external : 1; /* the channel lives in memory provided by CspChan_init */
+    unsigned short copyKind : 3; /* selects the copy routine suited for msgLen */
+    unsigned short fused : 2; /* FusedSend or FusedReceive; data points to a Fusion */
+    unsigned short sharded : 1; /* data points to Shards; the channel itself has no ring buffer */
+    unsigned short fullPolicy : 2;
+    unsigned short order : 2;
     union
     {
-        struct { unsigned short queueLen, msgCount, rIdx, wIdx; };
+        struct
+        {
+            unsigned short queueLen, msgCount, rIdx, wIdx, cap; /* cap >= queueLen is the number of slots in data */
+            volatile unsigned int seq; /* FullConflate: odd while a send is writing the slot */
+        };
         void* dataPtr;
     };
-
-    Signals observer;
-    unsigned char data[]; /* assumes flexible array members C89 extension, or a C99 compiler, or try with data[0] */
+    unsigned char* data; /* points to the storage following the struct, or to a separate allocation */
+    Waiters* w; /* points to the Waiters following the struct, or (compact) to a separate allocation or NULL */
 } CspChan_t;
 
+/* C89 compile time assertion; CSPCHAN_SIZEOF_MAX must be an upper bound of CspChan_sizeof */
+typedef char CspChan_header_fits[sizeof(CspChan_t) + sizeof(Waiters) <= CSPCHAN_MAX_HEADER ? 1 : -1];
+
 #define CSP_CHECK(call) if( (call)!= 0 ) fprintf(stderr,"error calling " #call " in " __FILE__ " line %d\n", __LINE__);
 #define CSP_WARN_CLOSED(c) if( (c)->closed ) fprintf(stderr,"warning: using closed channel in " __FILE__ " line %d\n", __LINE__);
 
+static size_t round_up(size_t len, size_t unit)
+{
+    return (len + unit - 1) / unit * unit;
+}
+
+static size_t ring_mapping_len(CspChan_t* c)
+{
+    if( c->mirrored )
+        return 2 * (size_t)c->cap * c->msgLen;
+    return round_up((size_t)c->cap * c->msgLen, c->huge ? HugePageSize : (size_t)sysconf(_SC_PAGESIZE));
+}
+
+static void prefault_and_lock(void* p, size_t mapLen, unsigned int flags)
+{
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    if( flags & CspChan_Prefault )
+    {
+        /* touch each page, so the first messages don't pay for the page faults */
+        volatile unsigned char* b = (unsigned char*)p;
+        size_t i;
+        for( i = 0; i < mapLen; i += pageSize )
+            b[i] = 0;
+    }
+    if( flags & CspChan_Locked )
+        mlock(p, mapLen); /* best effort, fails if RLIMIT_MEMLOCK is too small */
+}
+
+static int map_mirrored_ring(CspChan_t* c, unsigned int flags)
+{
+#ifdef MFD_CLOEXEC
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    /* the wrap point must coincide with the end of the first mapping, so the ring must consist of whole
+       pages; use the smallest number of slots >= queueLen which fills whole pages */
+    size_t a = pageSize, b = c->msgLen;
+    while( b != 0 )
+    {
+        const size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    const size_t cap = round_up(c->queueLen, pageSize / a); /* a is gcd(pageSize, msgLen) */
+    if( cap > 0xffff || cap * c->msgLen > 4 * round_up((size_t)c->queueLen * c->msgLen, pageSize) )
+        return 0; /* not worth it; the caller falls back to a normal ring */
+    const size_t len = cap * c->msgLen;
+    const int fd = memfd_create("CspChan", MFD_CLOEXEC);
+    if( fd < 0 )
+        return 0;
+    unsigned char* base = MAP_FAILED;
+    if( ftruncate(fd, len) == 0 )
+        base = (unsigned char*)mmap(0, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( base != MAP_FAILED )
+    {
+        /* replace the reserved address range by two views of the same memory */
+        if( mmap(base, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                mmap(base + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED )
+        {
+            munmap(base, 2 * len);
+            base = MAP_FAILED;
+        }
+    }
+    close(fd); /* the mappings keep the memory alive */
+    if( base == MAP_FAILED )
+        return 0;
+    prefault_and_lock(base, len, flags);
+    c->data = base;
+    c->cap = cap;
+    c->mapped = 1;
+    c->mirrored = 1;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static int map_ring(CspChan_t* c, unsigned int flags)
+{
+    if( (flags & CspChan_Mirrored) && map_mirrored_ring(c, flags) )
+        return 1;
+    const size_t len = (size_t)c->queueLen * c->msgLen;
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    void* p = MAP_FAILED;
+    size_t mapLen = 0;
+    c->huge = 0;
+#ifdef MAP_HUGETLB
+    if( flags & CspChan_HugePages )
+    {
+        /* explicit huge pages only exist if the administrator reserved some (vm.nr_hugepages) */
+        mapLen = round_up(len, HugePageSize);
+        p = mmap(0, mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if( p != MAP_FAILED )
+            c->huge = 1;
+    }
+#endif
+    if( p == MAP_FAILED )
+    {
+        mapLen = round_up(len, pageSize);
+        p = mmap(0, mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if( p == MAP_FAILED )
+            return 0;
+#ifdef MADV_HUGEPAGE
+        /* fall back to transparent huge pages; if not available either we simply end up with normal pages */
+        if( (flags & CspChan_HugePages) && mapLen >= HugePageSize )
+            madvise(p, mapLen, MADV_HUGEPAGE);
+#endif
+    }
+    prefault_and_lock(p, mapLen, flags);
+    c->data = (unsigned char*)p;
+    c->mapped = 1;
+    return 1;
+}
+
+static void init_waiters(Waiters* w)
+{
+    memset(&w->observer,0,sizeof(CspChan_Waiter));
+    w->observer.prev = w->observer.next = &w->observer;
+    w->waiting = 0;
+    w->coalesceMin = 0;
+    w->coalesceMs = 0;
+    w->counters = 0;
+    w->index = 0;
+    w->aqm = 0;
+    w->tune = 0;
+    CSP_CHECK(pthread_mutex_init(&w->srMtx,0));
+    CSP_CHECK(pthread_mutex_init(&w->observerMtx,0));
+    CSP_CHECK(pthread_cond_init(&w->condA,0));
+    CSP_CHECK(pthread_cond_init(&w->condB,0));
+}
+
+static CspChan_Stats* counters(Waiters* w)
+{
+    /* we come here with the channel locked; most channels never count anything, so they don't carry
+       the counters */
+    if( w->counters == 0 )
+        w->counters = (CspChan_Stats*)calloc(1, sizeof(CspChan_Stats));
+    return w->counters;
+}
+
+static void destroy_waiters(Waiters* w)
+{
+    CSP_CHECK(pthread_cond_destroy(&w->condB));
+    CSP_CHECK(pthread_cond_destroy(&w->condA));
+    CSP_CHECK(pthread_mutex_destroy(&w->observerMtx));
+    CSP_CHECK(pthread_mutex_destroy(&w->srMtx));
+}
+
 CspChan_t* CspChan_create(unsigned short queueLen, unsigned short msgLen)
+{
+    return CspChan_create_ex(queueLen, msgLen, 0);
+}
+
+static size_t channel_size(unsigned short queueLen, unsigned short msgLen, unsigned int flags)
 {
     if( msgLen == 0 )
         msgLen = 1;
+    const int mapped = queueLen != 0 &&
+            (flags & (CspChan_HugePages | CspChan_Prefault | CspChan_Locked | CspChan_Mirrored));
+    const int lazy = queueLen != 0 && !mapped && (flags & CspChan_Lazy);
+    if( flags & CspChan_Compact )
+        return sizeof(CspChan_t);
+    return sizeof(CspChan_t) + sizeof(Waiters) + (mapped || lazy ? 0 : queueLen*msgLen);
+}
+
+static CspChan_t* init_channel(void* mem, unsigned short queueLen, unsigned short msgLen, unsigned int flags)
+{
+    if( msgLen == 0 )
+        msgLen = 1;
+    const int mapped = queueLen != 0 &&
+            (flags & (CspChan_HugePages | CspChan_Prefault | CspChan_Locked | CspChan_Mirrored));
+    const int compact = (flags & CspChan_Compact) != 0;
+    const int lazy = queueLen != 0 && !mapped && (flags & CspChan_Lazy);
     /* queueLen == 0 is an unbuffered channel */
-    CspChan_t* c = (CspChan_t*)malloc(sizeof(CspChan_t) + queueLen*msgLen);
+    CspChan_t* c = (CspChan_t*)mem;
+    c->lock = 0;
     c->msgLen = msgLen;
     c->closed = 0;
+    c->mapped = 0;
+    c->huge = 0;
+    c->mirrored = 0;
+    c->compact = compact;
+    c->heap = 0;
+    c->lazy = lazy;
+    c->external = 0;
+    c->fused = NotFused;
+    c->sharded = 0;
+    c->order = RingOrder;
+    if( flags & CspChan_Conflate )
+        c->fullPolicy = FullConflate;
+    else if( flags & CspChan_OverwriteOldest )
+        c->fullPolicy = FullOverwrite;
+    else if( flags & CspChan_DropNewest )
+        c->fullPolicy = FullDrop;
+    else
+        c->fullPolicy = FullBlock;
+    switch( msgLen )
+    {
+    case 1: c->copyKind = Copy1; break;
+    case 2: c->copyKind = Copy2; break;
+    case 4: c->copyKind = Copy4; break;
+    case 8: c->copyKind = Copy8; break;
+    case 16: c->copyKind = Copy16; break;
+    default: c->copyKind = msgLen >= NonTemporalBytes && (flags & CspChan_NonTemporal) ? CopyLarge : CopyAny; break;
+    }
+    if( compact )
+    {
+        /* both the waiters and the ring buffer are allocated on demand */
+        c->w = 0;
+        c->data = 0;
+    }else
+    {
+        c->w = (Waiters*)(c + 1);
+        c->data = lazy ? 0 : (unsigned char*)(c->w + 1);
+        init_waiters(c->w);
+    }
     if( queueLen == 0 )
     {
         c->unbuffered = 1;
@@ -73,52 +395,469 @@ CspChan_t* CspChan_create(unsigned short queueLen, unsigned short msgLen)
     {
         c->unbuffered = 0;
         c->queueLen = queueLen;
+        c->cap = lazy ? 0 : queueLen;
         c->msgCount = 0;
         c->rIdx = 0;
         c->wIdx = 0;
+        c->seq = 0;
+        if( mapped && !map_ring(c, flags) )
+        {
+            fprintf(stderr,"error mapping %lu bytes for channel ring buffer\n", (unsigned long)queueLen*msgLen);
+            if( c->w )
+                destroy_waiters(c->w);
+            return 0;
+        }
     }
-    memset(&c->observer,0,sizeof(Signals));
-    CSP_CHECK(pthread_mutex_init(&c->srMtx,0));
-    CSP_CHECK(pthread_mutex_init(&c->observerMtx,0));
-    CSP_CHECK(pthread_cond_init(&c->condA,0));
-    CSP_CHECK(pthread_cond_init(&c->condB,0));
     return c;
 }
 
-static void signal_all(CspChan_t* c)
+static CspChan_t* create_sharded(unsigned short queueLen, unsigned short msgLen, unsigned int flags);
+
+CspChan_t* CspChan_create_ex(unsigned short queueLen, unsigned short msgLen, unsigned int flags)
+{
+    if( queueLen != 0 && (flags & CspChan_Conflate) )
+    {
+        /* the slot must stay where it is for CspChan_latest, and be the only one (a mapped ring is rounded up
+           to whole pages) */
+        queueLen = 1;
+        flags &= ~(CspChan_Lazy | CspChan_Sharded | CspChan_HugePages | CspChan_Prefault | CspChan_Locked |
+                   CspChan_Mirrored);
+    }
+    if( queueLen != 0 && (flags & CspChan_Sharded) )
+        return create_sharded(queueLen, msgLen, flags & ~CspChan_Sharded);
+    void* mem = malloc(channel_size(queueLen, msgLen, flags));
+    if( mem == 0 )
+        return 0;
+    CspChan_t* c = init_channel(mem, queueLen, msgLen, flags);
+    if( c == 0 )
+        free(mem);
+    return c;
+}
+
+CspChan_t* CspChan_create_keyed(unsigned short queueLen, unsigned short msgLen, unsigned short keyLen)
+{
+    if( queueLen == 0 || keyLen == 0 || keyLen > msgLen )
+        return 0;
+    unsigned int entries = 2;
+    while( entries < 2 * (unsigned int)queueLen )
+        entries *= 2;
+    /* the index follows the ring buffer in the same allocation */
+    const size_t size = round_up(channel_size(queueLen, msgLen, 0), sizeof(void*));
+    unsigned char* mem = (unsigned char*)malloc(size + sizeof(Keys) + entries * sizeof(unsigned short));
+    CspChan_t* c = init_channel(mem, queueLen, msgLen, 0);
+    Keys* k = (Keys*)(mem + size);
+    k->keyLen = keyLen;
+    k->mask = entries - 1;
+    k->entry = (unsigned short*)(k + 1);
+    memset(k->entry, 0, entries * sizeof(unsigned short));
+    c->w->index = k;
+    c->order = KeyedOrder;
+    return c;
+}
+
+static CspChan_t* create_heap(unsigned short queueLen, unsigned short msgLen, int order)
+{
+    /* the heap follows the ring buffer in the same allocation */
+    const size_t size = round_up(channel_size(queueLen, msgLen, 0), sizeof(long long));
+    unsigned char* mem = (unsigned char*)malloc(size + sizeof(Heap) +
+                                                queueLen * (sizeof(long long) + sizeof(unsigned int) + 2 * sizeof(unsigned short)));
+    CspChan_t* c = init_channel(mem, queueLen, msgLen, 0);
+    Heap* h = (Heap*)(mem + size);
+    h->next = 0;
+    h->rank = (long long*)(h + 1);
+    h->seq = (unsigned int*)(h->rank + queueLen);
+    h->node = (unsigned short*)(h->seq + queueLen);
+    h->unused = h->node + queueLen;
+    unsigned int i;
+    for( i = 0; i < queueLen; i++ )
+        h->unused[i] = queueLen - 1 - i;
+    c->w->index = h;
+    c->order = order;
+    return c;
+}
+
+CspChan_t* CspChan_create_priority(unsigned short queueLen, unsigned short msgLen)
+{
+    if( queueLen == 0 || msgLen < sizeof(int) )
+        return 0;
+    return create_heap(queueLen, msgLen, PriorityOrder);
+}
+
+CspChan_t* CspChan_create_delayed(unsigned short queueLen, unsigned short msgLen)
+{
+    if( queueLen == 0 )
+        return 0;
+    return create_heap(queueLen, msgLen, DelayOrder);
+}
+
+unsigned int CspChan_sizeof(unsigned short queueLen, unsigned short msgLen)
+{
+    return channel_size(queueLen, msgLen, 0);
+}
+
+CspChan_t* CspChan_init(void* mem, unsigned short queueLen, unsigned short msgLen)
+{
+    CspChan_t* c = init_channel(mem, queueLen, msgLen, 0);
+    c->external = 1;
+    return c;
+}
+
+static CspChan_t* fuse(CspChan_t* other, unsigned short msgLen, CspChan_Transform fn, void* ctx, int kind)
+{
+    /* a fused channel has neither waiters nor a ring buffer of its own; it passes everything on to other */
+    CspChan_t* c = init_channel(malloc(sizeof(CspChan_t) + sizeof(Fusion)), 0, msgLen, CspChan_Compact);
+    Fusion* f = (Fusion*)(c + 1);
+    f->fn = fn;
+    f->ctx = ctx;
+    f->other = other;
+    c->data = (unsigned char*)f;
+    c->fused = kind;
+    return c;
+}
+
+CspChan_t* CspChan_fuse(CspChan_t* downstream, unsigned short msgLen, CspChan_Transform fn, void* ctx)
+{
+    return fuse(downstream, msgLen, fn, ctx, FusedSend);
+}
+
+CspChan_t* CspChan_fuse_receive(CspChan_t* upstream, unsigned short msgLen, CspChan_Transform fn, void* ctx)
+{
+    return fuse(upstream, msgLen, fn, ctx, FusedReceive);
+}
+
+static void lock(CspChan_t* c)
 {
-    CSP_CHECK(pthread_mutex_lock(&c->observerMtx));
-    Signals* s = &c->observer;
-    while( s )
+    if( !c->compact )
+    {
+        CSP_CHECK(pthread_mutex_lock(&c->w->srMtx));
+        return;
+    }
+    int spins = 0;
+    while( __sync_lock_test_and_set(&c->lock, 1) )
     {
-        int i;
-        for( i = 0; i < SignalsCount; i++ )
+        /* the lock is never held while waiting or blocking, so it is usually released very soon */
+        while( c->lock )
         {
-            if( s->sig[i] )
-                CSP_CHECK(pthread_cond_signal(s->sig[i]));
+            if( ++spins > 100 )
+                sched_yield();
         }
+    }
+}
+
+static int trylock(CspChan_t* c)
+{
+    if( !c->compact )
+        return pthread_mutex_trylock(&c->w->srMtx) == 0;
+    return __sync_lock_test_and_set(&c->lock, 1) == 0;
+}
+
+static void unlock(CspChan_t* c)
+{
+    if( !c->compact )
+    {
+        CSP_CHECK(pthread_mutex_unlock(&c->w->srMtx));
+    }else
+        __sync_lock_release(&c->lock);
+}
+
+static Waiters* waiters(CspChan_t* c)
+{
+    /* we come here with c locked */
+    if( c->w == 0 )
+    {
+        Waiters* w = (Waiters*)malloc(sizeof(Waiters));
+        init_waiters(w);
+        __sync_synchronize(); /* make the initialized struct visible before the pointer */
+        c->w = w;
+    }
+    return c->w;
+}
+
+static pthread_cond_t* cond_of(Waiters* w, int which)
+{
+    return which == CondA ? &w->condA : &w->condB;
+}
+
+/* An agent blocked in a channel operation, registered for the artificial deadlock resolution or the
+   simulation */
+typedef struct BlockedAgent
+{
+    CspChan_t* sendingTo; /* the full buffered channel the agent waits to send to, or NULL */
+    unsigned long long deadline; /* when the wait times out (in simulated time), or 0 */
+    unsigned int progress; /* the progress count when the agent blocked */
+    int checking; /* the agent was the last one to block and waits for StallCheckMs */
+    struct BlockedAgent* next;
+} BlockedAgent;
+
+/* The registry of agents for the artificial deadlock resolution (see CspChan_resolve_deadlocks) and the
+   simulation (see CspChan_simulate) */
+static struct
+{
+    pthread_mutex_t mtx;
+    pthread_cond_t tick; /* broadcast when the simulated clock advances */
+    int enabled; /* the artificial deadlock resolution */
+    int simulated;
+    unsigned int agents; /* threads started by CspChan_fork while tracked, and the thread which started tracking */
+    unsigned int blocked; /* agents waiting in a channel operation or CspChan_sleep */
+    unsigned int progress; /* incremented whenever a blocked agent continues */
+    unsigned int quiet; /* the progress count when quietSince was taken */
+    unsigned long long quietSince; /* real time */
+    unsigned long long now; /* the simulated time */
+    BlockedAgent* waiting; /* the blocked agents */
+} parks = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+static unsigned long long real_ms(void)
+{
+    /* CLOCK_REALTIME, because this is what pthread_cond_timedwait uses by default */
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long long now_ms(void)
+{
+    return parks.simulated ? parks.now : real_ms();
+}
+
+static unsigned int now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int)((unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void advance_clock(void)
+{
+    /* we come here with parks.mtx locked, after a slice of real time has passed in a timed wait in
+       simulation; if all agents were blocked since the last slice, and none has yet to notice that its
+       deadline has passed, the clock jumps to the earliest deadline */
+    const unsigned long long real = real_ms();
+    if( parks.agents == 0 || parks.blocked != parks.agents || parks.progress != parks.quiet )
+    {
+        parks.quiet = parks.progress;
+        parks.quietSince = real;
+        return;
+    }
+    if( real < parks.quietSince + SimSliceMs )
+        return;
+    unsigned long long next = 0;
+    BlockedAgent* a;
+    for( a = parks.waiting; a != 0; a = a->next )
+    {
+        if( a->deadline != 0 && a->deadline <= parks.now )
+            return;
+        if( a->deadline != 0 && (next == 0 || a->deadline < next) )
+            next = a->deadline;
+    }
+    if( next != 0 )
+    {
+        parks.now = next;
+        CSP_CHECK(pthread_cond_broadcast(&parks.tick));
+    }
+}
+
+static int timed_wait(pthread_cond_t* cond, pthread_mutex_t* mtx, unsigned long long deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000;
+    ts.tv_nsec = (deadline % 1000) * 1000000;
+    const int res = pthread_cond_timedwait(cond,mtx,&ts);
+    if( res != 0 && res != ETIMEDOUT )
+        fprintf(stderr,"error calling pthread_cond_timedwait in " __FILE__ " line %d\n", __LINE__);
+    return res == 0;
+}
+
+static int cond_wait_until(pthread_cond_t* cond, pthread_mutex_t* mtx, unsigned long long deadline)
+{
+    if( deadline == 0 )
+    {
+        CSP_CHECK(pthread_cond_wait(cond,mtx));
+        return 1;
+    }
+    if( !parks.simulated )
+        return timed_wait(cond,mtx,deadline);
+    /* the deadline is simulated time; wait slices of real time, and see after each whether the clock can
+       advance; the agent stays blocked meanwhile, so the slices don't count as progress */
+    for(;;)
+    {
+        if( timed_wait(cond,mtx,real_ms() + SimSliceMs) )
+            return 1;
+        CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+        advance_clock();
+        const int res = parks.simulated && parks.now < deadline;
+        CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+        if( !res )
+            return 0;
+    }
+}
+
+static int is_full(CspChan_t* c);
+static int is_empty(CspChan_t* c);
+static int growable(CspChan_t* c);
+static void resolve_stall(CspChan_t* grow, CspChan_t* held);
+
+static CspChan_t* stalled(unsigned int progress)
+{
+    /* we come here with parks.mtx locked; if all agents are still blocked since progress, returns the
+       smallest full channel an agent waits to send to (Parks' algorithm), or NULL */
+    if( parks.agents == 0 || parks.blocked != parks.agents || parks.progress != progress )
+        return 0;
+    CspChan_t* grow = 0;
+    BlockedAgent* a;
+    for( a = parks.waiting; a != 0; a = a->next )
+    {
+        if( a->sendingTo && growable(a->sendingTo) && (grow == 0 || a->sendingTo->queueLen < grow->queueLen) )
+            grow = a->sendingTo;
+    }
+    return grow;
+}
+
+static void park(BlockedAgent* self, CspChan_t* sendingTo, unsigned long long* deadline)
+{
+    /* called before an agent waits; if it is the last one to block, it only waits for StallCheckMs, and
+       then checks whether all agents are still blocked */
+    CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+    parks.blocked++;
+    self->sendingTo = sendingTo;
+    self->progress = parks.progress;
+    self->checking = parks.enabled && parks.blocked == parks.agents && *deadline == 0;
+    if( self->checking )
+        *deadline = now_ms() + StallCheckMs;
+    self->deadline = *deadline;
+    self->next = parks.waiting;
+    parks.waiting = self;
+    CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+}
+
+static CspChan_t* unpark(BlockedAgent* self, int timedOut)
+{
+    /* called when the agent continues; returns the channel to grow if a stall was confirmed */
+    CspChan_t* grow = 0;
+    CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+    if( self->checking && timedOut )
+        grow = stalled(self->progress); /* the agent itself still counts as blocked */
+    else
+        parks.progress++; /* the timeout of a check is no progress, otherwise two agents could keep
+                             invalidating each other's check */
+    BlockedAgent** a = &parks.waiting;
+    while( *a != self )
+        a = &(*a)->next;
+    *a = self->next;
+    parks.blocked--;
+    CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+    return grow;
+}
+
+static int wait_until(CspChan_t* c, int which, unsigned long long deadline)
+{
+    /* we come here with c locked, and return with c locked; deadline 0 means no timeout;
+       returns 0 if the deadline has passed */
+    Waiters* w = waiters(c);
+    int res;
+    BlockedAgent self;
+    const int sending = which == CondA && !c->unbuffered && is_full(c);
+    const int parked = parks.enabled || parks.simulated;
+    if( parked )
+        park(&self, sending ? c : 0, &deadline);
+    w->waiting++;
+    if( !c->compact )
+        res = cond_wait_until(cond_of(w,which),&w->srMtx,deadline);
+    else
+    {
+        /* w->srMtx is taken before the spin lock is released, and every wake() takes it too; thus a
+           wake() following a state change can only happen once we are actually waiting */
+        CSP_CHECK(pthread_mutex_lock(&w->srMtx));
+        unlock(c);
+        res = cond_wait_until(cond_of(w,which),&w->srMtx,deadline);
+        CSP_CHECK(pthread_mutex_unlock(&w->srMtx));
+        lock(c);
+    }
+    w->waiting--;
+    if( parked )
+    {
+        CspChan_t* grow = unpark(&self, !res);
+        if( grow )
+            resolve_stall(grow, c);
+    }
+    return res;
+}
+
+static void wait_on(CspChan_t* c, int which)
+{
+    wait_until(c,which,0);
+}
+
+static void wake(CspChan_t* c, int which, int all)
+{
+    /* we come here with c unlocked */
+    Waiters* w = c->w;
+    if( w == 0 )
+        return; /* a compact channel nobody has waited for yet */
+    if( c->compact )
+        CSP_CHECK(pthread_mutex_lock(&w->srMtx));
+    if( all )
+    {
+        CSP_CHECK(pthread_cond_broadcast(cond_of(w,which)));
+    }else
+        CSP_CHECK(pthread_cond_signal(cond_of(w,which)));
+    if( c->compact )
+        CSP_CHECK(pthread_mutex_unlock(&w->srMtx));
+}
+
+static void signal_all(CspChan_t* c)
+{
+    if( c->w == 0 )
+        return;
+    CSP_CHECK(pthread_mutex_lock(&c->w->observerMtx));
+    CspChan_Waiter* s = c->w->observer.next;
+    while( s != &c->w->observer )
+    {
+        s->notify(s);
         s = s->next;
     }
-    CSP_CHECK(pthread_mutex_unlock(&c->observerMtx));
+    CSP_CHECK(pthread_mutex_unlock(&c->w->observerMtx));
 }
 
 void CspChan_dispose(CspChan_t* c)
+{
+    const int external = c->external;
+    CspChan_deinit(c);
+    if( !external )
+        free(c);
+}
+
+static void dispose_shards(CspChan_t* c);
+
+void CspChan_deinit(CspChan_t* c)
 {
     CspChan_close(c);
 
-    CSP_CHECK(pthread_cond_destroy(&c->condB));
-    CSP_CHECK(pthread_cond_destroy(&c->condA));
-    CSP_CHECK(pthread_mutex_destroy(&c->observerMtx));
-    CSP_CHECK(pthread_mutex_destroy(&c->srMtx));
+    /* all threads are signalled while the channel is locked, so the only ones which still might access the
+       channel are those which were waiting; give them the chance to leave */
+    lock(c);
+    while( c->w && c->w->waiting )
+    {
+        unlock(c);
+        sched_yield();
+        lock(c);
+    }
+    unlock(c);
 
-    Signals* s = c->observer.next;
-    while(s)
+    if( c->sharded )
+        dispose_shards(c); /* before the waiters, since the shards forward their notifications to them */
+    if( c->w )
     {
-        Signals* ss = s;
-        s = s->next;
-        free(ss);
+        free(c->w->counters);
+        free(c->w->aqm);
+        free(c->w->tune);
+        destroy_waiters(c->w);
+        if( c->compact )
+            free(c->w);
     }
-    free(c);
+    if( c->mapped )
+        munmap(c->data, ring_mapping_len(c));
+    else if( c->heap )
+        free(c->data);
 }
 
 static int is_full(CspChan_t* c)
@@ -126,85 +865,762 @@ static int is_full(CspChan_t* c)
     return c->msgCount == c->queueLen;
 }
 
+static unsigned int key_hash(const unsigned char* key, unsigned int len)
+{
+    /* FNV-1a */
+    unsigned int h = 2166136261u;
+    unsigned int i;
+    for( i = 0; i < len; i++ )
+        h = (h ^ key[i]) * 16777619u;
+    return h;
+}
+
+static unsigned short* find_key(CspChan_t* c, const void* msg)
+{
+    /* returns the index entry for the key of msg, which is 0 if the key is not pending */
+    Keys* k = (Keys*)c->w->index;
+    unsigned int i = key_hash((const unsigned char*)msg, k->keyLen) & k->mask;
+    while( k->entry[i] != 0 && memcmp(c->data + (k->entry[i] - 1) * c->msgLen, msg, k->keyLen) != 0 )
+        i = (i + 1) & k->mask;
+    return &k->entry[i];
+}
+
+static void remove_key(CspChan_t* c, unsigned int slot)
+{
+    /* removes the key of the message in the given ring slot from the index; the entries following it in
+       the probe sequence are shifted back, so no tombstones are needed */
+    Keys* k = (Keys*)c->w->index;
+    unsigned int i = (unsigned int)(find_key(c, c->data + slot * c->msgLen) - k->entry);
+    unsigned int j = i;
+    k->entry[i] = 0;
+    for(;;)
+    {
+        j = (j + 1) & k->mask;
+        if( k->entry[j] == 0 )
+            break;
+        const unsigned int home = key_hash(c->data + (k->entry[j] - 1) * c->msgLen, k->keyLen) & k->mask;
+        /* the entry at j can move to the gap at i if its home is not in the cyclic range (i, j] */
+        if( i <= j ? (home <= i || home > j) : (home <= i && home > j) )
+        {
+            k->entry[i] = k->entry[j];
+            k->entry[j] = 0;
+            i = j;
+        }
+    }
+}
+
+static int can_send(CspChan_t* c, const void* data)
+{
+    /* data is the message to be sent; a keyed channel is never full for a pending key */
+    return !is_full(c) || c->fullPolicy != FullBlock || (c->order == KeyedOrder && *find_key(c, data) != 0);
+}
+
 static int is_empty(CspChan_t* c)
 {
     return c->msgCount == 0;
 }
 
-static void add_observer(CspChan_t* c, pthread_cond_t* sig)
+static void add_waiter(CspChan_t* c, CspChan_Waiter* s)
 {
-    CSP_CHECK(pthread_mutex_lock(&c->observerMtx));
-    Signals* s = &c->observer;
-    while( s )
+    lock(c);
+    Waiters* w = waiters(c);
+    unlock(c);
+    CSP_CHECK(pthread_mutex_lock(&w->observerMtx));
+    s->chan = c;
+    s->prev = &w->observer;
+    s->next = w->observer.next;
+    w->observer.next->prev = s;
+    w->observer.next = s;
+    CSP_CHECK(pthread_mutex_unlock(&w->observerMtx));
+}
+
+static void remove_waiter(CspChan_Waiter* s)
+{
+    Waiters* w = s->chan->w; /* add_waiter has allocated it */
+    /* once observerMtx is released, signal_all is no longer using s */
+    CSP_CHECK(pthread_mutex_lock(&w->observerMtx));
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+    s->prev = s->next = 0;
+    CSP_CHECK(pthread_mutex_unlock(&w->observerMtx));
+}
+
+static void notify_observer(CspChan_Waiter* s)
+{
+    Observer* o = (Observer*)s->ctx;
+    /* taking the mutex makes sure the observer is either waiting or has not checked yet */
+    CSP_CHECK(pthread_mutex_lock(o->mtx));
+    CSP_CHECK(pthread_cond_signal(o->sig));
+    CSP_CHECK(pthread_mutex_unlock(o->mtx));
+}
+
+static void notify_forward(CspChan_Waiter* s)
+{
+    /* we come here with the shard locked; nobody locks a shard while holding observerMtx of the channel */
+    signal_all((CspChan_t*)s->ctx);
+}
+
+static CspChan_t* create_sharded(unsigned short queueLen, unsigned short msgLen, unsigned int flags)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if( count < MinShards )
+        count = MinShards;
+    if( count > queueLen )
+        count = queueLen;
+    /* the channel itself only carries the waiters for select and the blocking receive */
+    CspChan_t* c = init_channel(malloc(channel_size(0, msgLen, 0)), 0, msgLen, 0);
+    Shards* sh = (Shards*)malloc(sizeof(Shards) + count * (sizeof(CspChan_t*) + sizeof(CspChan_Waiter)));
+    sh->count = count;
+    sh->next = 0;
+    sh->shard = (CspChan_t**)(sh + 1);
+    sh->forward = (CspChan_Waiter*)(sh->shard + count);
+    unsigned int i;
+    for( i = 0; i < sh->count; i++ )
     {
-        int i;
-        for( i = 0; i < SignalsCount; i++ )
+        sh->shard[i] = CspChan_create_ex((queueLen + count - 1) / count, msgLen, flags);
+        if( sh->shard[i] == 0 )
         {
-            if( s->sig[i] == 0 )
+            /* c->data doesn't point to the shards yet, so dispose_shards doesn't apply */
+            while( i-- > 0 )
             {
-                s->sig[i] = sig;
-                CSP_CHECK(pthread_mutex_unlock(&c->observerMtx));
-                return;
+                remove_waiter(&sh->forward[i]);
+                CspChan_dispose(sh->shard[i]);
             }
+            free(sh);
+            destroy_waiters(c->w);
+            free(c);
+            return 0;
         }
-        s = s->next;
+        sh->forward[i].notify = notify_forward;
+        sh->forward[i].ctx = c;
+        add_waiter(sh->shard[i], &sh->forward[i]);
+    }
+    c->unbuffered = 0;
+    c->queueLen = queueLen;
+    c->msgCount = c->rIdx = c->wIdx = c->cap = 0;
+    c->data = (unsigned char*)sh;
+    c->sharded = 1;
+    return c;
+}
+
+static void dispose_shards(CspChan_t* c)
+{
+    Shards* sh = (Shards*)c->data;
+    unsigned int i;
+    for( i = 0; i < sh->count; i++ )
+    {
+        remove_waiter(&sh->forward[i]);
+        CspChan_dispose(sh->shard[i]);
+    }
+    free(sh);
+}
+
+static unsigned int threadCount = 0;
+static __thread unsigned int threadNumber = 0; /* 1 + the order in which the thread first sent to a sharded channel */
+
+static CspChan_t* own_shard(CspChan_t* c)
+{
+    /* each thread sticks to one shard, so the messages of a sender stay in order; since the threads are
+       numbered consecutively, they are evenly spread over the shards */
+    Shards* sh = (Shards*)c->data;
+    if( threadNumber == 0 )
+        threadNumber = __sync_add_and_fetch(&threadCount, 1);
+    return sh->shard[(threadNumber - 1) % sh->count];
+}
+
+static CspChan_t* ready_shard(CspChan_t* c, int receiving, int* busy)
+{
+    /* returns a shard ready for communication in locked state, or 0 */
+    Shards* sh = (Shards*)c->data;
+    if( !receiving )
+    {
+        CspChan_t* s = own_shard(c);
+        if( !trylock(s) )
+        {
+            (*busy)++;
+            return 0;
+        }
+        if( !s->closed && can_send(s,0) )
+            return s;
+        unlock(s);
+        return 0;
+    }
+    const unsigned int start = sh->next;
+    unsigned int i;
+    for( i = 0; i < sh->count; i++ )
+    {
+        const unsigned int j = (start + i) % sh->count;
+        CspChan_t* s = sh->shard[j];
+        if( !trylock(s) )
+        {
+            (*busy)++;
+            continue;
+        }
+        if( !is_empty(s) )
+        {
+            sh->next = (j + 1) % sh->count; /* round-robin, so no producer is starved */
+            return s;
+        }
+        unlock(s);
+    }
+    return 0;
+}
+
+static void copy_stream(unsigned char* to, const unsigned char* from, size_t len)
+{
+#ifdef __SSE2__
+    /* non-temporal stores write around the cache, so a large message doesn't evict the producer's working set,
+       and the consumer fetches it from memory anyway */
+    const size_t head = (16 - ((size_t)to & 15)) & 15;
+    memcpy(to, from, head);
+    to += head;
+    from += head;
+    len -= head;
+    while( len >= 64 )
+    {
+        const __m128i a = _mm_loadu_si128((const __m128i*)from);
+        const __m128i b = _mm_loadu_si128((const __m128i*)(from + 16));
+        const __m128i c = _mm_loadu_si128((const __m128i*)(from + 32));
+        const __m128i d = _mm_loadu_si128((const __m128i*)(from + 48));
+        _mm_stream_si128((__m128i*)to, a);
+        _mm_stream_si128((__m128i*)(to + 16), b);
+        _mm_stream_si128((__m128i*)(to + 32), c);
+        _mm_stream_si128((__m128i*)(to + 48), d);
+        to += 64;
+        from += 64;
+        len -= 64;
+    }
+    _mm_sfence(); /* streaming stores are weakly ordered; make them visible before the channel is unlocked */
+#endif
+    memcpy(to, from, len);
+}
+
+static void copy_msg(CspChan_t* c, void* to, const void* from)
+{
+    /* memcpy with a constant size compiles to plain loads and stores without alignment requirements;
+       larger messages go to the libc memcpy, which already is vectorized */
+    switch( c->copyKind )
+    {
+    case Copy1:
+        *(unsigned char*)to = *(const unsigned char*)from;
+        break;
+    case Copy2:
+        memcpy(to, from, 2);
+        break;
+    case Copy4:
+        memcpy(to, from, 4);
+        break;
+    case Copy8:
+        memcpy(to, from, 8);
+        break;
+    case Copy16:
+        memcpy(to, from, 16);
+        break;
+    default:
+        memcpy(to, from, c->msgLen);
+        break;
+    }
+}
+
+static void copy_to_ring(CspChan_t* c, void* to, const void* from)
+{
+    if( c->copyKind == CopyLarge )
+        copy_stream((unsigned char*)to, (const unsigned char*)from, c->msgLen);
+    else
+        copy_msg(c, to, from);
+}
+
+static void copy_batch(CspChan_t* c, unsigned char* to, const unsigned char* from, unsigned int n, int toRing)
+{
+    /* copies n consecutive messages; only writes to the ring use streaming stores, as in copy_to_ring */
+    if( toRing && c->copyKind == CopyLarge )
+        copy_stream(to, from, (size_t)n * c->msgLen);
+    else if( n == 1 )
+        copy_msg(c, to, from);
+    else
+        memcpy(to, from, (size_t)n * c->msgLen);
+}
+
+static void relocate_ring(CspChan_t* c, unsigned int newCap)
+{
+    /* copy the buffered messages in order to the start of a new ring buffer of newCap slots */
+    unsigned char* data = newCap ? (unsigned char*)malloc((size_t)newCap * c->msgLen) : 0;
+    if( c->msgCount )
+    {
+        const unsigned int first = c->rIdx + c->msgCount <= c->cap ? c->msgCount : c->cap - c->rIdx;
+        memcpy(data, c->data + c->rIdx * c->msgLen, first * c->msgLen);
+        memcpy(data + first * c->msgLen, c->data, (c->msgCount - first) * c->msgLen);
     }
-    s = (Signals*)malloc(sizeof(Signals));
-    memset(s,0,sizeof(Signals));
-    s->sig[0] = sig;
-    s->next = c->observer.next;
-    c->observer.next = s;
+    if( c->mapped )
+    {
+        munmap(c->data, ring_mapping_len(c));
+        c->mapped = c->huge = c->mirrored = 0;
+    }else if( c->heap )
+        free(c->data);
+    c->data = data;
+    c->heap = data != 0;
+    c->cap = newCap;
+    c->rIdx = 0;
+    c->wIdx = newCap ? c->msgCount % newCap : 0;
+}
 
-    CSP_CHECK(pthread_mutex_unlock(&c->observerMtx));
+static int growable(CspChan_t* c)
+{
+    /* the storage of the other orders is allocated together with their index, and the slot of a
+       conflating channel must not move */
+    return !c->unbuffered && !c->fused && !c->sharded && !c->closed && c->order == RingOrder &&
+            c->fullPolicy != FullConflate;
 }
 
-static void remove_observer(CspChan_t* c, pthread_cond_t* sig)
+static int relocate_queue(CspChan_t* c, unsigned int queueLen)
 {
-    CSP_CHECK(pthread_mutex_lock(&c->observerMtx));
-    Signals* s = &c->observer;
-    while( s )
+    /* we come here with c locked; changes queueLen keeping the buffered messages in order */
+    if( !growable(c) || queueLen == 0 || queueLen > 0xffff || queueLen < c->msgCount )
+        return 0;
+    const unsigned int rIdx = c->rIdx, cap = c->cap;
+    if( c->lazy )
+    {
+        if( c->cap > queueLen )
+            relocate_ring(c, queueLen);
+    }else if( c->data != 0 )
+        relocate_ring(c, queueLen);
+    else
+        c->cap = queueLen; /* a compact channel allocates its ring buffer with the first message */
+    c->queueLen = queueLen;
+    Codel* q = c->w ? c->w->aqm : 0;
+    if( q )
+    {
+        /* the send times are relocated the same way as the messages; one per slot of the new ring */
+        Codel* nq = (Codel*)malloc(sizeof(Codel) + c->cap * sizeof(unsigned int));
+        *nq = *q;
+        nq->enqueued = (unsigned int*)(nq + 1);
+        unsigned int i;
+        for( i = 0; i < c->msgCount; i++ )
+            nq->enqueued[i] = q->enqueued[(rIdx + i) % cap];
+        c->w->aqm = nq;
+        free(q);
+    }
+    return 1;
+}
+
+static void tune(CspChan_t* c, unsigned int sent)
+{
+    /* we come here with c locked after sent messages were added; at the end of each window, queueLen is
+       doubled if more sends blocked than targeted, and halved if few blocked and at most half of the
+       ring buffer was used; if the receivers waited for most messages, the channel is mostly empty, so a
+       larger buffer wouldn't help, but a smaller one saves memory */
+    Waiters* w = c->w;
+    Tuning* t = w->tune;
+    t->sends += sent;
+    if( c->msgCount > t->peak )
+        t->peak = c->msgCount;
+    if( t->sends < TuneWindow )
+        return;
+    const unsigned long blocked = counters(w)->blockedSends - t->blockedAtStart;
+    const unsigned long rate = blocked * 1000 / t->sends;
+    const int starved = (counters(w)->blockedReceives - t->starvedAtStart) * 2 > t->sends;
+    unsigned int len = c->queueLen;
+    if( rate > t->target && !starved && len < t->maxLen )
     {
-        int i;
-        for( i = 0; i < SignalsCount; i++ )
+        len *= 2;
+        if( len > t->maxLen )
+            len = t->maxLen;
+    }else if( (blocked == 0 || rate * 2 < t->target) && (t->peak <= len / 2 || starved) && len > t->minLen )
+    {
+        len /= 2;
+        if( len < t->minLen )
+            len = t->minLen;
+        if( len < c->msgCount )
+            len = c->msgCount;
+    }
+    if( len != c->queueLen )
+    {
+        const int up = len > c->queueLen;
+        if( relocate_queue(c, len) )
         {
-            if( s->sig[i] == sig )
+            if( up )
             {
-                s->sig[i] = 0;
-                CSP_CHECK(pthread_mutex_unlock(&c->observerMtx));
-                return;
-            }
+                counters(w)->tunedUp++;
+                wake(c,CondA,1);
+            }else
+                counters(w)->tunedDown++;
         }
-        s = s->next;
     }
-    CSP_CHECK(pthread_mutex_unlock(&c->observerMtx));
+    t->sends = 0;
+    t->peak = c->msgCount;
+    t->blockedAtStart = counters(w)->blockedSends;
+    t->starvedAtStart = counters(w)->blockedReceives;
+}
+
+static unsigned int initial_cap(CspChan_t* c)
+{
+    unsigned int cap = LazyInitialBytes / c->msgLen;
+    if( cap == 0 )
+        cap = 1;
+    if( cap > c->queueLen )
+        cap = c->queueLen;
+    return cap;
+}
+
+static unsigned char* ring(CspChan_t* c, unsigned int count)
+{
+    /* make room for count messages; compact and lazy channels allocate their ring buffer with the first
+       message, and lazy ones grow it geometrically up to queueLen */
+    if( c->data == 0 && !c->lazy )
+    {
+        c->data = (unsigned char*)malloc((size_t)c->cap * c->msgLen);
+        c->heap = 1;
+    }else if( c->msgCount + count > c->cap )
+    {
+        unsigned int cap = c->cap ? c->cap : initial_cap(c);
+        while( cap < c->msgCount + count )
+            cap *= 2;
+        if( cap > c->queueLen )
+            cap = c->queueLen;
+        relocate_ring(c, cap);
+    }
+    return c->data;
+}
+
+static void shrink_ring(CspChan_t* c)
+{
+    /* the hysteresis between growing at cap and shrinking at cap/4 keeps the copying cost amortized O(1) */
+    if( c->lazy && c->msgCount <= c->cap / 4 && c->cap / 2 >= initial_cap(c) )
+        relocate_ring(c, c->cap / 2);
+}
+
+static int heap_before(Heap* h, unsigned int a, unsigned int b)
+{
+    if( h->rank[a] != h->rank[b] )
+        return h->rank[a] < h->rank[b];
+    return (int)(h->seq[a] - h->seq[b]) < 0; /* correct across the wrap around of the sequence numbers */
+}
+
+static unsigned int heap_push(CspChan_t* c, const void* data, long long rank)
+{
+    /* returns the position in the heap, i.e. 0 if the message is the first to be received */
+    Heap* h = (Heap*)c->w->index;
+    const unsigned short slot = h->unused[c->queueLen - c->msgCount - 1];
+    copy_to_ring(c, c->data + slot * c->msgLen, data);
+    h->rank[slot] = rank;
+    h->seq[slot] = h->next++;
+    unsigned int i = c->msgCount++;
+    while( i > 0 )
+    {
+        const unsigned int parent = (i - 1) / HeapArity;
+        if( !heap_before(h, slot, h->node[parent]) )
+            break;
+        h->node[i] = h->node[parent];
+        i = parent;
+    }
+    h->node[i] = slot;
+    return i;
+}
+
+static void heap_pop(CspChan_t* c, void* data)
+{
+    Heap* h = (Heap*)c->w->index;
+    const unsigned short top = h->node[0];
+    copy_msg(c, data, c->data + top * c->msgLen);
+    c->msgCount--;
+    h->unused[c->queueLen - c->msgCount - 1] = top;
+    const unsigned short last = h->node[c->msgCount];
+    unsigned int i = 0;
+    for(;;)
+    {
+        const unsigned int first = i * HeapArity + 1;
+        if( first >= c->msgCount )
+            break;
+        unsigned int j, child = first;
+        for( j = first + 1; j < first + HeapArity && j < c->msgCount; j++ )
+        {
+            if( heap_before(h, h->node[j], h->node[child]) )
+                child = j;
+        }
+        if( !heap_before(h, h->node[child], last) )
+            break;
+        h->node[i] = h->node[child];
+        i = child;
+    }
+    h->node[i] = last;
+}
+
+static unsigned long long heap_due(CspChan_t* c)
+{
+    /* the due time of the first message of a delay channel */
+    Heap* h = (Heap*)c->w->index;
+    return (unsigned long long)h->rank[h->node[0]];
+}
+
+static long long priority_rank(const void* data)
+{
+    int prio;
+    memcpy(&prio, data, sizeof(int));
+    return -(long long)prio; /* the highest priority has the lowest rank */
+}
+
+static unsigned int control_law(Codel* q, unsigned int t)
+{
+    /* t + interval / sqrt(count); the square root in 8 bit fixed point */
+    const unsigned long long x = (unsigned long long)q->count << 16;
+    unsigned long long r = x, y = (x + 1) / 2;
+    while( y < r )
+    {
+        r = y;
+        y = (y + x / y) / 2;
+    }
+    return t + (unsigned int)(((unsigned long long)q->interval << 8) / r);
+}
+
+static int codel_ok_to_drop(CspChan_t* c, Codel* q, unsigned int now)
+{
+    /* the last message is never shed, so the receiver always gets one */
+    if( c->msgCount <= 1 || now - q->enqueued[c->rIdx] < q->target )
+    {
+        q->firstAbove = 0;
+        return 0;
+    }
+    if( q->firstAbove == 0 )
+    {
+        q->firstAbove = (now + q->interval) | 1;
+        return 0;
+    }
+    return (int)(now - q->firstAbove) >= 0;
+}
+
+static void shed_head(CspChan_t* c, Codel* q)
+{
+    /* the divert channel is only tried, since we must not block with c locked */
+    void* msg = c->data + c->rIdx * c->msgLen;
+    if( q->divert && CspChan_nb_select(0,0,0,&q->divert,&msg,1) == 0 )
+        counters(c->w)->diverted++;
+    else
+        counters(c->w)->shed++;
+    c->rIdx = (c->rIdx + 1) % c->cap;
+    c->msgCount--;
+}
+
+static void codel_shed(CspChan_t* c, Codel* q)
+{
+    /* the dequeue part of CoDel (RFC 8289), called before the first message is received; it sheds messages
+       while they stay longer than target in the channel, at a rate increasing with the square root of the
+       number shed, until the delay drops below target */
+    const unsigned int now = now_us();
+    const int ok = codel_ok_to_drop(c, q, now);
+    if( q->dropping )
+    {
+        if( !ok )
+            q->dropping = 0;
+        while( q->dropping && (int)(now - q->dropNext) >= 0 )
+        {
+            shed_head(c, q);
+            q->count++;
+            if( !codel_ok_to_drop(c, q, now) )
+                q->dropping = 0;
+            else
+                q->dropNext = control_law(q, q->dropNext);
+        }
+    }else if( ok )
+    {
+        shed_head(c, q);
+        q->dropping = 1;
+        /* if dropping stopped only recently, continue at about the previous rate */
+        const unsigned int delta = q->count - q->lastCount;
+        q->count = delta > 1 && now - q->dropNext < 16 * q->interval ? delta : 1;
+        q->dropNext = control_law(q, now);
+        q->lastCount = q->count;
+    }
+}
+
+static int make_room(CspChan_t* c)
+{
+    /* we come here with c locked and full, and fullPolicy not FullBlock; returns 0 if the message to be
+       sent is to be dropped instead */
+    Waiters* w = waiters(c);
+    if( c->fullPolicy == FullDrop )
+    {
+        counters(w)->dropped++;
+        return 0;
+    }
+    if( c->order == KeyedOrder )
+        remove_key(c, c->rIdx);
+    c->rIdx = (c->rIdx + 1) % c->cap;
+    c->msgCount--;
+    counters(w)->overwritten++;
+    return 1;
 }
 
 static void send(CspChan_t* c, void* data)
 {
     if( c->closed )
         return;
-    memcpy(c->data + c->wIdx * c->msgLen, data, c->msgLen);
-    c->wIdx = (c->wIdx + 1) % c->queueLen;
+    if( c->order == KeyedOrder )
+    {
+        unsigned short* e = find_key(c, data);
+        if( *e != 0 )
+        {
+            copy_to_ring(c, c->data + (*e - 1) * c->msgLen, data);
+            counters(c->w)->replaced++;
+            return;
+        }
+    }
+    if( is_full(c) && c->fullPolicy != FullBlock && !make_room(c) )
+        return;
+    if( c->order == PriorityOrder || c->order == DelayOrder )
+    {
+        heap_push(c, data, c->order == PriorityOrder ? priority_rank(data) : (long long)now_ms());
+        return;
+    }
+    if( c->order == KeyedOrder )
+        *find_key(c, data) = c->wIdx + 1;
+    if( c->w && c->w->aqm )
+        c->w->aqm->enqueued[c->wIdx] = now_us();
+    if( c->fullPolicy == FullConflate )
+    {
+        /* the sequence lock of CspChan_latest; the senders themselves are serialized by the channel lock */
+        c->seq++;
+        __sync_synchronize();
+    }
+    copy_to_ring(c, ring(c,1) + c->wIdx * c->msgLen, data);
+    c->wIdx = (c->wIdx + 1) % c->cap;
     c->msgCount++;
+    if( c->fullPolicy == FullConflate )
+    {
+        __sync_synchronize();
+        c->seq++;
+    }
+    if( c->w && c->w->tune )
+        tune(c, 1);
+}
+
+static void send_n(CspChan_t* c, const unsigned char* data, unsigned int n)
+{
+    ring(c,n);
+    if( c->w && c->w->aqm )
+    {
+        const unsigned int now = now_us();
+        unsigned int i;
+        for( i = 0; i < n; i++ )
+            c->w->aqm->enqueued[(c->wIdx + i) % c->cap] = now;
+    }
+    /* a mirrored ring can be written across the wrap point in one go */
+    const unsigned int first = c->mirrored || c->wIdx + n <= c->cap ? n : (unsigned int)(c->cap - c->wIdx);
+    copy_batch(c, c->data + c->wIdx * c->msgLen, data, first, 1);
+    if( first < n )
+        copy_batch(c, c->data, data + first * c->msgLen, n - first, 1);
+    c->wIdx = (c->wIdx + n) % c->cap;
+    c->msgCount += n;
+    if( c->w && c->w->tune )
+        tune(c, n);
 }
 
 static void receive(CspChan_t* c, void* data)
 {
     if( c->closed )
         return;
-    memcpy(data, c->data + c->rIdx * c->msgLen, c->msgLen);
-    c->rIdx = (c->rIdx + 1) % c->queueLen;
+    if( c->order == PriorityOrder || c->order == DelayOrder )
+    {
+        heap_pop(c, data);
+        return;
+    }
+    if( c->order == KeyedOrder )
+        remove_key(c, c->rIdx);
+    if( c->w && c->w->aqm )
+        codel_shed(c, c->w->aqm);
+    copy_msg(c, data, c->data + c->rIdx * c->msgLen);
+    c->rIdx = (c->rIdx + 1) % c->cap;
     c->msgCount--;
+    shrink_ring(c);
+}
+
+static unsigned int receive_n(CspChan_t* c, unsigned char* data, unsigned int n)
+{
+    /* returns the number of messages received; fewer than n only for a delay channel, since only the
+       messages already due are received */
+    if( c->order == PriorityOrder || c->order == DelayOrder )
+    {
+        const unsigned long long now = c->order == DelayOrder ? now_ms() : 0;
+        unsigned int i;
+        for( i = 0; i < n; i++ )
+        {
+            if( c->order == DelayOrder && i > 0 && heap_due(c) > now )
+                return i;
+            heap_pop(c, data + i * c->msgLen);
+        }
+        return n;
+    }
+    if( c->order == KeyedOrder )
+    {
+        unsigned int i;
+        for( i = 0; i < n; i++ )
+            remove_key(c, (c->rIdx + i) % c->cap);
+    }
+    if( c->w && c->w->aqm )
+    {
+        codel_shed(c, c->w->aqm);
+        if( n > c->msgCount )
+            n = c->msgCount;
+    }
+    const unsigned int first = c->mirrored || c->rIdx + n <= c->cap ? n : (unsigned int)(c->cap - c->rIdx);
+    copy_batch(c, data, c->data + c->rIdx * c->msgLen, first, 0);
+    if( first < n )
+        copy_batch(c, data + first * c->msgLen, c->data, n - first, 0);
+    c->rIdx = (c->rIdx + n) % c->cap;
+    c->msgCount -= n;
+    shrink_ring(c);
+    return n;
+}
+
+static void wake_receiver(CspChan_t* c, int all)
+{
+    /* with coalescing, a sleeping receiver is only woken when enough messages are queued; its timer
+       takes care of the rest */
+    Waiters* w = c->w;
+    if( w && w->coalesceMin > 1 && c->msgCount < w->coalesceMin && !is_full(c) )
+        return;
+    wake(c,CondB,all);
+}
+
+static int can_receive(CspChan_t* c)
+{
+    return !is_empty(c) && (c->order != DelayOrder || heap_due(c) <= now_ms());
+}
+
+static void wait_not_empty(CspChan_t* c)
+{
+    if( !c->closed && is_empty(c) )
+        counters(waiters(c))->blockedReceives++; /* once per receive, however often it wakes up */
+    /* a lazy channel which stays empty for a while gives its ring buffer back */
+    const unsigned long long idleSince = c->lazy ? now_ms() : 0;
+    while( !c->closed && !can_receive(c) )
+    {
+        if( !is_empty(c) )
+            wait_until(c,CondB,heap_due(c)); /* a delay channel whose first message is not due yet */
+        else if( c->w && c->w->coalesceMin > 1 )
+        {
+            /* starts over if still empty; the coalescing delay is usually much shorter than LazyIdleMs */
+            if( !wait_until(c,CondB,now_ms() + c->w->coalesceMs) && c->lazy && is_empty(c) && c->data != 0 &&
+                    now_ms() >= idleSince + LazyIdleMs )
+                relocate_ring(c, 0);
+        }else if( c->lazy && c->data != 0 )
+        {
+            if( !wait_until(c,CondB,now_ms() + LazyIdleMs) && is_empty(c) && c->data != 0 )
+                relocate_ring(c, 0);
+        }else
+            wait_on(c,CondB);
+    }
 }
 
-static void synctwo(CspChan_t* c, void* dataPtr, int thisIsSender)
+static int synctwo(CspChan_t* c, void* dataPtr, int thisIsSender)
 {
+    /* returns 1 if the message was passed, 0 if the channel was closed */
+    int res = 1;
 start:
     /* we come here with srMtx already locked */
     if( c->closed )
     {
-        CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
-        return;
+        unlock(c);
+        return 0;
     }
     switch( c->barrierPhase )
     {
@@ -214,38 +1630,122 @@ start:
         c->dataPtr = dataPtr;
         signal_all(c);
         while( !c->closed && c->barrierPhase != 2 )
-            CSP_CHECK(pthread_cond_wait(&c->condA,&c->srMtx));
+            wait_on(c,CondA);
+        res = c->barrierPhase == 2;
         c->barrierPhase = 0;
-        CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
-        /* here a third thread can interfere */
-        CSP_CHECK(pthread_cond_signal(&c->condB));
+        wake(c,CondB,0);
+        unlock(c);
         break;
     case 1: /* I'm the second */
         if( c->expectingSender != thisIsSender )
         {
-            /* the caller is not the expected one, wait for another and send this one to sleep */
-            CSP_CHECK(pthread_cond_wait(&c->condB,&c->srMtx));
-            goto start;
+            /* the caller is not the expected one, wait for another and send this one to sleep */
+            wait_on(c,CondB);
+            goto start;
+        }
+        if( thisIsSender )
+            copy_msg(c,c->dataPtr,dataPtr);
+        else
+            copy_msg(c,dataPtr,c->dataPtr);
+        c->barrierPhase = 2;
+        wake(c,CondA,0);
+        unlock(c);
+        break;
+    case 2: /* channel occupied, wait */
+        wait_on(c,CondB);
+        goto start;
+        break;
+    }
+    return res;
+}
+
+static int fused_send(CspChan_t* c, void* dataPtr)
+{
+    Fusion* f = (Fusion*)c->data;
+    CSP_WARN_CLOSED(c);
+    if( c->fused != FusedSend )
+    {
+        fprintf(stderr,"warning: sending to a receive side fused channel\n");
+        return 0;
+    }
+    if( c->closed )
+        return 0;
+    unsigned char local[FusionLocalBytes];
+    unsigned char* out = f->other->msgLen <= FusionLocalBytes ? local : (unsigned char*)malloc(f->other->msgLen);
+    /* runs in the thread of the sender; a chain of fused channels ends up in one call stack */
+    if( f->fn(f->ctx, dataPtr, out) )
+        CspChan_send(f->other, out);
+    if( out != local )
+        free(out);
+    return 1;
+}
+
+static int fused_receive(CspChan_t* c, void* dataPtr)
+{
+    Fusion* f = (Fusion*)c->data;
+    if( c->fused != FusedReceive )
+    {
+        fprintf(stderr,"warning: receiving from a send side fused channel\n");
+        return 0;
+    }
+    unsigned char local[FusionLocalBytes];
+    unsigned char* in = f->other->msgLen <= FusionLocalBytes ? local : (unsigned char*)malloc(f->other->msgLen);
+    int res = 0;
+    while( !c->closed && CspChan_receive_n(f->other, in, 1) )
+    {
+        if( f->fn(f->ctx, in, dataPtr) )
+        {
+            res = 1;
+            break;
         }
-        if( thisIsSender )
-            memcpy(c->dataPtr,dataPtr,c->msgLen);
-        else
-            memcpy(dataPtr,c->dataPtr,c->msgLen);
-        c->barrierPhase = 2;
-        CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
-        /* here a third thread can interfere */
-        CSP_CHECK(pthread_cond_signal(&c->condA));
-        break;
-    case 2: /* channel occupied, wait */
-        CSP_CHECK(pthread_cond_wait(&c->condB,&c->srMtx));
-        goto start;
-        break;
     }
+    if( !res )
+        memset(dataPtr,0,c->msgLen);
+    if( in != local )
+        free(in);
+    return res;
+}
+
+static unsigned int sharded_receive_n(CspChan_t* c, void* dataPtr, unsigned int count)
+{
+    int busy;
+    do
+    {
+        if( c->closed )
+            return 0;
+        busy = 0;
+        CspChan_t* s = ready_shard(c, 1, &busy);
+        if( s )
+        {
+            unsigned int n = s->msgCount;
+            if( n > count )
+                n = count;
+            receive_n(s, (unsigned char*)dataPtr, n);
+            signal_all(s);
+            wake(s,CondA,n > 1);
+            unlock(s);
+            return n;
+        }
+        if( busy )
+            sched_yield();
+    }while( busy );
+    /* all shards are empty; wait for any of them as select does */
+    return CspChan_select(&c, &dataPtr, 1, 0, 0, 0) == 0;
 }
 
 void CspChan_send(CspChan_t* c, void* dataPtr)
 {
-    CSP_CHECK(pthread_mutex_lock(&c->srMtx));
+    if( c->fused )
+    {
+        fused_send(c, dataPtr);
+        return;
+    }
+    if( c->sharded )
+    {
+        CspChan_send(own_shard(c), dataPtr);
+        return;
+    }
+    lock(c);
 
     CSP_WARN_CLOSED(c); /* TODO: Golang panics in this case */
 
@@ -254,27 +1754,67 @@ void CspChan_send(CspChan_t* c, void* dataPtr)
         synctwo(c,dataPtr,1);
     }else
     {
-        while( !c->closed && is_full(c) )
-            CSP_CHECK(pthread_cond_wait(&c->condA,&c->srMtx));
+        if( !c->closed && !can_send(c,dataPtr) )
+            counters(waiters(c))->blockedSends++; /* once per send, however often it wakes up */
+        while( !c->closed && !can_send(c,dataPtr) )
+            wait_on(c,CondA);
 
         send(c,dataPtr);
 
-        CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
-
-        /* NOTE: if the receiver disposes of the channel before the following is complete, a segfault might occur;
-           the order is relevant; c->sent must be signalled last, because observers usually don't dispose the channel */
+        /* everything is signalled before unlocking, so the receiver can safely dispose of the channel
+           as soon as it gets the message */
         signal_all(c);
-        CSP_CHECK(pthread_cond_signal(&c->condB));
+        wake_receiver(c,0);
+
+        unlock(c);
+    }
+}
+
+void CspChan_send_delayed(CspChan_t* c, void* dataPtr, unsigned int delayMs)
+{
+    if( c->order != DelayOrder )
+    {
+        CspChan_send(c, dataPtr);
+        return;
+    }
+    lock(c);
+    CSP_WARN_CLOSED(c);
+    if( !c->closed && is_full(c) )
+        counters(waiters(c))->blockedSends++;
+    while( !c->closed && is_full(c) )
+        wait_on(c,CondA);
+    if( c->closed )
+    {
+        unlock(c);
+        return;
     }
+    /* if the message is due first, the waiting receivers have to start over with the new due time */
+    const int first = heap_push(c, dataPtr, (long long)(now_ms() + delayMs)) == 0;
+    signal_all(c);
+    if( first )
+        wake(c,CondB,1);
+    unlock(c);
 }
 
 void CspChan_receive(CspChan_t* c, void* dataPtr)
 {
-    CSP_CHECK(pthread_mutex_lock(&c->srMtx));
+    if( c->fused )
+    {
+        fused_receive(c, dataPtr);
+        return;
+    }
+    if( c->sharded )
+    {
+        if( !sharded_receive_n(c, dataPtr, 1) )
+            memset(dataPtr,0,c->msgLen);
+        return;
+    }
+    lock(c);
 
     if( c->closed )
     {
         memset(dataPtr,0,c->msgLen);
+        unlock(c);
         return;
     }
 
@@ -283,22 +1823,116 @@ void CspChan_receive(CspChan_t* c, void* dataPtr)
         synctwo(c,dataPtr,0);
     }else
     {
-        while( !c->closed && is_empty(c) )
-            CSP_CHECK(pthread_cond_wait(&c->condB,&c->srMtx));
+        wait_not_empty(c);
 
         receive(c,dataPtr);
 
-        CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
+        signal_all(c);
+        wake(c,CondA,0);
+
+        unlock(c);
+    }
+}
 
+unsigned int CspChan_send_n(CspChan_t* c, void* dataPtr, unsigned int count)
+{
+    unsigned char* data = (unsigned char*)dataPtr;
+    unsigned int done = 0;
+    if( c->fused )
+    {
+        while( done < count && fused_send(c, data + done * c->msgLen) )
+            done++;
+        return done;
+    }
+    if( c->sharded )
+        return CspChan_send_n(own_shard(c), dataPtr, count);
+    if( c->unbuffered )
+    {
+        while( done < count )
+        {
+            lock(c);
+            CSP_WARN_CLOSED(c);
+            if( !synctwo(c, data + done * c->msgLen, 1) )
+                break;
+            done++;
+        }
+        return done;
+    }
+    if( c->fullPolicy != FullBlock || c->order != RingOrder )
+    {
+        /* lossy channels never block, the messages which don't fit are discarded one by one according to
+           the policy; keyed channels have to look up each message anyway */
+        while( done < count && !c->closed )
+        {
+            CspChan_send(c, data + done * c->msgLen);
+            done++;
+        }
+        return done;
+    }
+    while( done < count )
+    {
+        lock(c);
+        CSP_WARN_CLOSED(c);
+        if( !c->closed && is_full(c) )
+            counters(waiters(c))->blockedSends++;
+        while( !c->closed && is_full(c) )
+            wait_on(c,CondA);
+        if( c->closed )
+        {
+            unlock(c);
+            break;
+        }
+        unsigned int n = c->queueLen - c->msgCount;
+        if( n > count - done )
+            n = count - done;
+        send_n(c, data + done * c->msgLen, n);
+        done += n;
         signal_all(c);
-        CSP_CHECK(pthread_cond_signal(&c->condA));
+        wake_receiver(c,1); /* there might be more than one message for more than one receiver */
+        unlock(c);
+    }
+    return done;
+}
+
+unsigned int CspChan_receive_n(CspChan_t* c, void* dataPtr, unsigned int count)
+{
+    if( count == 0 )
+        return 0;
+    if( c->fused )
+        return fused_receive(c, dataPtr);
+    if( c->sharded )
+        return sharded_receive_n(c, dataPtr, count);
+    if( c->unbuffered )
+    {
+        lock(c);
+        return synctwo(c, dataPtr, 0);
+    }
+    lock(c);
+    wait_not_empty(c);
+    if( c->closed )
+    {
+        unlock(c);
+        return 0;
     }
+    unsigned int n = c->msgCount;
+    if( n > count )
+        n = count;
+    n = receive_n(c, (unsigned char*)dataPtr, n);
+    signal_all(c);
+    wake(c,CondA,1);
+    unlock(c);
+    return n;
 }
 
 static int anyready(CspChan_t** receiver, unsigned int rCount,
-                     CspChan_t** sender, unsigned int sCount, CspChan_t** ready)
+                     CspChan_t** sender, void** sData, unsigned int sCount, CspChan_t** ready, int* busy,
+                     unsigned long long* due)
 {
+    /* if due is not NULL, it is set to the earliest due time of the delay channels not yet ready, or 0 */
+    if( due )
+        *due = 0;
     int i = 0, n = 0, closed = 0;
+    *busy = 0;
     while( i < (rCount+sCount) )
     {
         CspChan_t* c = 0;
@@ -309,11 +1943,22 @@ static int anyready(CspChan_t** receiver, unsigned int rCount,
             c = sender[i-rCount];
             CSP_WARN_CLOSED(c);
         }
-        if( c->closed )
+        if( c->fused )
         {
+            fprintf(stderr,"warning: fused channels are ignored by select\n");
             ready[i] = 0;
             closed++;
-        }else if( pthread_mutex_trylock(&c->srMtx) == 0 )
+        }else if( c->closed )
+        {
+            ready[i] = 0;
+            closed++;
+        }else if( c->sharded )
+        {
+            /* doselect then communicates with the shard instead of c */
+            ready[i] = ready_shard(c, i < rCount, busy);
+            if( ready[i] )
+                n++;
+        }else if( trylock(c) )
         {
             int ok = 0;
             if( c->unbuffered )
@@ -323,9 +1968,13 @@ static int anyready(CspChan_t** receiver, unsigned int rCount,
             }else
             {
                 if( i < rCount )
-                    ok = !is_empty(c);
+                {
+                    ok = can_receive(c);
+                    if( !ok && due && !is_empty(c) && (*due == 0 || heap_due(c) < *due) )
+                        *due = heap_due(c);
+                }
                 else
-                    ok = !is_full(c);
+                    ok = can_send(c,sData[i-rCount]);
             }
 
             if( ok )
@@ -335,10 +1984,14 @@ static int anyready(CspChan_t** receiver, unsigned int rCount,
             }else
             {
                 ready[i] = 0;
-                CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
+                unlock(c);
             }
         }else
+        {
+            /* the lock holder might just be changing the state we are waiting for */
             ready[i] = 0;
+            (*busy)++;
+        }
         i++;
     }
     if( n == 0 && closed )
@@ -363,76 +2016,119 @@ static int doselect(int n, void** rData, unsigned int rCount, void** sData, unsi
                 c = ready[i];
                 n = i;
             }else
-                CSP_CHECK(pthread_mutex_unlock(&ready[i]->srMtx));
+                unlock(ready[i]);
             candidate--;
         }
     }
     if( c->unbuffered )
     {
         if( n >= rCount )
-            memcpy(c->dataPtr,sData[n-rCount],c->msgLen);
+            copy_msg(c,c->dataPtr,sData[n-rCount]);
         else
-            memcpy(rData[n],c->dataPtr,c->msgLen);
+            copy_msg(c,rData[n],c->dataPtr);
         c->barrierPhase = 2;
-        CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
         signal_all(c);
-        CSP_CHECK(pthread_cond_signal(&c->condA));
+        wake(c,CondA,0);
+        unlock(c);
     }else
     {
         if( n < rCount )
         {
             receive(c,rData[n]);
-            CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
             signal_all(c);
-            CSP_CHECK(pthread_cond_signal(&c->condA));
+            wake(c,CondA,0);
+            unlock(c);
         }else
         {
             send(c,sData[n-rCount]);
-            CSP_CHECK(pthread_mutex_unlock(&c->srMtx));
             signal_all(c);
-            CSP_CHECK(pthread_cond_signal(&c->condB));
+            wake_receiver(c,0);
+            unlock(c);
         }
     }
     return n;
 }
 
-int CspChan_select(CspChan_t** receiver, void** rData, unsigned int rCount,
-                         CspChan_t** sender, void** sData, unsigned int sCount)
+static CspChan_t* full_sender(CspChan_t** sender, unsigned int sCount)
 {
-    CspChan_t** ready = (CspChan_t**)malloc(sizeof(CspChan_t*)*(rCount+sCount));
+    /* returns the smallest full channel a select waits to send to, as a candidate for the artificial deadlock
+       resolution; read without locking, since resolve_stall checks again */
+    CspChan_t* res = 0;
+    unsigned int i;
+    for( i = 0; i < sCount; i++ )
+    {
+        CspChan_t* c = sender[i];
+        if( growable(c) && is_full(c) && (res == 0 || c->queueLen < res->queueLen) )
+            res = c;
+    }
+    return res;
+}
+
+static int select_until(CspChan_t** receiver, void** rData, unsigned int rCount,
+                        CspChan_t** sender, void** sData, unsigned int sCount, unsigned long long deadline)
+{
+    /* deadline 0 means no timeout */
+    CspChan_t** ready = (CspChan_t**)malloc((sizeof(CspChan_t*)+sizeof(CspChan_Waiter))*(rCount+sCount));
+    CspChan_Waiter* waiter = (CspChan_Waiter*)(ready + rCount + sCount);
 
     pthread_mutex_t mtx;
     pthread_cond_t sig;
+    Observer o;
 
     CSP_CHECK(pthread_mutex_init(&mtx,0));
     CSP_CHECK(pthread_cond_init(&sig,0));
-
-    CSP_CHECK(pthread_mutex_lock(&mtx));
+    o.mtx = &mtx;
+    o.sig = &sig;
 
     int i;
     for( i = 0; i < (rCount+sCount); i++ )
     {
-        if( i < rCount )
-            add_observer(receiver[i], &sig);
-        else
-            add_observer(sender[i-rCount], &sig);
+        waiter[i].notify = notify_observer;
+        waiter[i].ctx = &o;
+        add_waiter(i < rCount ? receiver[i] : sender[i-rCount], &waiter[i]);
     }
 
-    int n;
-    while( (n = anyready(receiver, rCount, sender, sCount, ready)) == 0  )
-        CSP_CHECK(pthread_cond_wait(&sig,&mtx));
+    /* mtx must not be held while calling into the observer lists, because signal_all locks it */
+    CSP_CHECK(pthread_mutex_lock(&mtx));
+    int n, busy, timedOut = 0;
+    unsigned long long due;
+    while( (n = anyready(receiver, rCount, sender, sData, sCount, ready, &busy, &due)) == 0 && !timedOut )
+    {
+        if( busy )
+        {
+            /* we cannot tell whether a busy channel is ready, and its notification might have been sent
+               before we wait; so rather check again */
+            CSP_CHECK(pthread_mutex_unlock(&mtx));
+            sched_yield();
+            CSP_CHECK(pthread_mutex_lock(&mtx));
+            timedOut = deadline != 0 && now_ms() >= deadline;
+        }else
+        {
+            /* a delay channel gets ready by itself */
+            unsigned long long until = due != 0 && (deadline == 0 || due < deadline) ? due : deadline;
+            BlockedAgent self;
+            const int parked = parks.enabled || parks.simulated;
+            if( parked )
+                park(&self, full_sender(sender, sCount), &until);
+            const int woken = cond_wait_until(&sig,&mtx,until);
+            CspChan_t* grow = parked ? unpark(&self, !woken) : 0;
+            if( grow )
+            {
+                /* mtx must not be held, since growing notifies the observers */
+                CSP_CHECK(pthread_mutex_unlock(&mtx));
+                resolve_stall(grow, 0);
+                CSP_CHECK(pthread_mutex_lock(&mtx));
+            }
+            timedOut = !woken && deadline != 0 && now_ms() >= deadline; /* check once more after the timeout */
+        }
+    }
+    CSP_CHECK(pthread_mutex_unlock(&mtx));
 
     n = doselect(n, rData, rCount, sData, sCount, ready );
 
     for( i = 0; i < (rCount+sCount); i++ )
-    {
-        if( i < rCount )
-            remove_observer(receiver[i], &sig);
-        else
-            remove_observer(sender[i-rCount], &sig);
-    }
+        remove_waiter(&waiter[i]);
 
-    CSP_CHECK(pthread_mutex_unlock(&mtx));
     CSP_CHECK(pthread_cond_destroy(&sig));
     CSP_CHECK(pthread_mutex_destroy(&mtx));
 
@@ -441,14 +2137,26 @@ int CspChan_select(CspChan_t** receiver, void** rData, unsigned int rCount,
     return n;
 }
 
+int CspChan_select(CspChan_t** receiver, void** rData, unsigned int rCount,
+                         CspChan_t** sender, void** sData, unsigned int sCount)
+{
+    return select_until(receiver, rData, rCount, sender, sData, sCount, 0);
+}
+
+int CspChan_timed_select(CspChan_t** receiver, void** rData, unsigned int rCount,
+                         CspChan_t** sender, void** sData, unsigned int sCount, unsigned int milliseconds)
+{
+    return select_until(receiver, rData, rCount, sender, sData, sCount, now_ms() + milliseconds);
+}
+
 int CspChan_nb_select(CspChan_t** receiver, void** rData, unsigned int rCount,
                       CspChan_t** sender, void** sData, unsigned int sCount)
 {
     CspChan_t** ready = (CspChan_t**)malloc(sizeof(CspChan_t*)*(rCount+sCount));
 
-    int n;
+    int n, busy;
 
-    n = anyready(receiver, rCount, sender, sCount, ready);
+    n = anyready(receiver, rCount, sender, sData, sCount, ready, &busy, 0);
     n = doselect(n, rData, rCount, sData, sCount, ready );
 
     free(ready);
@@ -456,18 +2164,205 @@ int CspChan_nb_select(CspChan_t** receiver, void** rData, unsigned int rCount,
     return n;
 }
 
-int CspChan_fork(void* (*agent)(void*), void* arg)
+enum { AsyncIdle, AsyncRunning, AsyncNotified, AsyncLocalReady = 16 };
+
+static int async_try(CspChan_Async* op)
+{
+    const unsigned int count = op->rCount + op->sCount;
+    CspChan_t* local[AsyncLocalReady];
+    CspChan_t** ready = count <= AsyncLocalReady ? local : (CspChan_t**)malloc(sizeof(CspChan_t*)*count);
+    int n, busy;
+    while( (n = anyready(op->receiver, op->rCount, op->sender, op->sData, op->sCount, ready, &busy, 0)) == 0 && busy )
+        sched_yield(); /* a busy channel might be ready, and its notification might already be gone */
+    n = n == 0 ? CspChan_Pending : doselect(n, op->rData, op->rCount, op->sData, op->sCount, ready);
+    if( ready != local )
+        free(ready);
+    return n;
+}
+
+static int async_step(CspChan_Async* op)
 {
+    /* we come here in state AsyncRunning or AsyncNotified; notifications meanwhile only set AsyncNotified,
+       so the op cannot be posted twice */
+    for(;;)
+    {
+        __sync_lock_test_and_set(&op->state, AsyncRunning);
+        const int n = async_try(op);
+        if( n != CspChan_Pending )
+        {
+            unsigned int i;
+            for( i = 0; i < op->rCount + op->sCount; i++ )
+                remove_waiter(&op->waiter[i]);
+            return n;
+        }
+        if( __sync_bool_compare_and_swap(&op->state, AsyncRunning, AsyncIdle) )
+            return CspChan_Pending; /* the next notification posts the op */
+        /* else something changed while we were trying */
+    }
+}
+
+static void async_run(CspChan_Job* j)
+{
+    CspChan_Async* op = (CspChan_Async*)j;
+    const int n = async_step(op);
+    if( n != CspChan_Pending )
+        op->done(op, n);
+}
+
+static void notify_async(CspChan_Waiter* s)
+{
+    CspChan_Async* op = (CspChan_Async*)s->ctx;
+    for(;;)
+    {
+        const int state = op->state;
+        if( state == AsyncIdle && __sync_bool_compare_and_swap(&op->state, AsyncIdle, AsyncRunning) )
+        {
+            CspChan_post(&op->job);
+            return;
+        }else if( state == AsyncRunning && __sync_bool_compare_and_swap(&op->state, AsyncRunning, AsyncNotified) )
+            return;
+        else if( state == AsyncNotified )
+            return;
+    }
+}
+
+int CspChan_async_select(CspChan_Async* op)
+{
+    int n = async_try(op);
+    if( n != CspChan_Pending )
+        return n;
+    op->job.run = async_run;
+    op->job.next = 0;
+    op->state = AsyncRunning;
+    unsigned int i;
+    for( i = 0; i < op->rCount + op->sCount; i++ )
+    {
+        op->waiter[i].notify = notify_async;
+        op->waiter[i].ctx = op;
+        add_waiter(i < op->rCount ? op->receiver[i] : op->sender[i-op->rCount], &op->waiter[i]);
+    }
+    /* check again, since the channels might have changed before the waiters were linked */
+    return async_step(op);
+}
+
+static int start_thread(void* (*run)(void*), void* arg)
+{
+    /* starts a detached thread which is not tracked as an agent; returns 0 or the pthread_create error */
     pthread_t t = 0;
     pthread_attr_t attr;
     CSP_CHECK(pthread_attr_init( &attr ));
     CSP_CHECK(pthread_attr_setdetachstate ( &attr , PTHREAD_CREATE_DETACHED ));
-    const int res = pthread_create(&t,&attr,agent,arg);
+    const int res = pthread_create(&t,&attr,run,arg);
     pthread_attr_destroy ( &attr );
     if( res != 0 )
     {
         fprintf(stderr,"error creating pthread: %d %s\n", res, strerror(res));
         fflush(stderr);
+    }
+    return res;
+}
+
+static struct
+{
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    CspChan_Job* first;
+    CspChan_Job* last;
+    int workers, idle;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0 };
+
+static void* pool_worker(void* arg)
+{
+    CSP_CHECK(pthread_mutex_lock(&pool.mtx));
+    for(;;)
+    {
+        while( pool.first == 0 )
+        {
+            pool.idle++;
+            CSP_CHECK(pthread_cond_wait(&pool.cond,&pool.mtx));
+            pool.idle--;
+        }
+        CspChan_Job* j = pool.first;
+        pool.first = j->next;
+        if( pool.first == 0 )
+            pool.last = 0;
+        CSP_CHECK(pthread_mutex_unlock(&pool.mtx));
+        j->run(j);
+        CSP_CHECK(pthread_mutex_lock(&pool.mtx));
+    }
+    return 0;
+}
+
+void CspChan_post(CspChan_Job* j)
+{
+    CSP_CHECK(pthread_mutex_lock(&pool.mtx));
+    j->next = 0;
+    if( pool.last )
+        pool.last->next = j;
+    else
+        pool.first = j;
+    pool.last = j;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    /* the workers are not agents (see CspChan_resolve_deadlocks), since they never block in a channel */
+    if( pool.idle == 0 && pool.workers < (cpus > 0 ? cpus : 1) && start_thread(pool_worker, 0) == 0 )
+        pool.workers++;
+    else
+        CSP_CHECK(pthread_cond_signal(&pool.cond));
+    CSP_CHECK(pthread_mutex_unlock(&pool.mtx));
+}
+
+typedef struct Agent
+{
+    void* (*agent)(void*);
+    void* arg;
+} Agent;
+
+static void* run_agent(void* arg)
+{
+    /* runs an agent registered for the artificial deadlock resolution or the simulation */
+    Agent a = *(Agent*)arg;
+    free(arg);
+    void* res = a.agent(a.arg);
+    CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+    parks.agents--;
+    /* if all the others are blocked, nobody else will notice */
+    const int suspect = parks.enabled && parks.agents != 0 && parks.blocked == parks.agents;
+    const unsigned int progress = parks.progress;
+    CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+    if( suspect )
+    {
+        usleep(StallCheckMs * 1000); /* not CspChan_sleep, since the thread is no agent anymore */
+        CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+        CspChan_t* grow = stalled(progress);
+        CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+        if( grow )
+            resolve_stall(grow, 0);
+    }
+    return res;
+}
+
+int CspChan_fork(void* (*agent)(void*), void* arg)
+{
+    CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+    if( parks.enabled || parks.simulated )
+    {
+        Agent* a = (Agent*)malloc(sizeof(Agent));
+        a->agent = agent;
+        a->arg = arg;
+        agent = run_agent;
+        arg = a;
+        parks.agents++;
+    }
+    CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+    if( start_thread(agent,arg) != 0 )
+    {
+        if( agent == run_agent )
+        {
+            free(arg);
+            CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+            parks.agents--;
+            CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+        }
         return 0;
     }else
         return 1;
@@ -475,17 +2370,44 @@ int CspChan_fork(void* (*agent)(void*), void* arg)
 
 void CspChan_sleep(unsigned int milliseconds)
 {
-    usleep(milliseconds*1000);
+    if( !parks.simulated )
+    {
+        usleep(milliseconds*1000);
+        return;
+    }
+    BlockedAgent self;
+    unsigned long long deadline = now_ms() + milliseconds;
+    park(&self, 0, &deadline);
+    CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+    while( parks.simulated && parks.now < deadline )
+    {
+        if( !timed_wait(&parks.tick, &parks.mtx, real_ms() + SimSliceMs) )
+            advance_clock();
+    }
+    CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+    unpark(&self, 0);
+}
+
+double CspChan_now(void)
+{
+    return (double)now_ms();
 }
 
 void CspChan_close(CspChan_t* c)
 {
-    pthread_mutex_lock(&c->srMtx);
+    lock(c);
     c->closed = 1;
-    pthread_mutex_unlock(&c->srMtx);
     signal_all(c);
-    pthread_cond_broadcast(&c->condB);
-    pthread_cond_broadcast(&c->condA);
+    wake(c,CondB,1);
+    wake(c,CondA,1);
+    unlock(c);
+    if( c->sharded )
+    {
+        Shards* sh = (Shards*)c->data;
+        unsigned int i;
+        for( i = 0; i < sh->count; i++ )
+            CspChan_close(sh->shard[i]);
+    }
 }
 
 int CspChan_closed(CspChan_t* c)
@@ -495,3 +2417,216 @@ int CspChan_closed(CspChan_t* c)
     else
         return 1;
 }
+
+static void resolve_stall(CspChan_t* grow, CspChan_t* held)
+{
+    /* held is the channel the caller has locked, if any */
+    if( grow != held )
+        lock(grow);
+    unsigned int queueLen = grow->queueLen * 2;
+    if( queueLen > 0xffff )
+        queueLen = 0xffff;
+    if( is_full(grow) && relocate_queue(grow, queueLen) )
+    {
+        counters(waiters(grow))->grown++;
+        signal_all(grow);
+        wake(grow,CondA,1);
+    }
+    if( grow != held )
+        unlock(grow);
+}
+
+static void track(int enabled, int simulated)
+{
+    /* we come here with parks.mtx locked */
+    const int before = parks.enabled || parks.simulated;
+    const int after = enabled || simulated;
+    if( after && !before )
+        parks.agents++; /* the calling thread */
+    else if( !after && before )
+        parks.agents--;
+    if( simulated && !parks.simulated )
+        parks.now = real_ms();
+    parks.enabled = enabled;
+    parks.simulated = simulated;
+    CSP_CHECK(pthread_cond_broadcast(&parks.tick)); /* simulated sleeps end when the simulation does */
+}
+
+void CspChan_resolve_deadlocks(int on)
+{
+    CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+    track(on != 0, parks.simulated);
+    CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+}
+
+void CspChan_simulate(int on)
+{
+    CSP_CHECK(pthread_mutex_lock(&parks.mtx));
+    track(parks.enabled, on != 0);
+    CSP_CHECK(pthread_mutex_unlock(&parks.mtx));
+}
+
+void CspChan_coalesce(CspChan_t* c, unsigned short minCount, unsigned int maxDelayMs)
+{
+    if( c->unbuffered || c->fused || c->sharded )
+        return;
+    lock(c);
+    Waiters* w = waiters(c);
+    w->coalesceMin = minCount;
+    w->coalesceMs = maxDelayMs ? maxDelayMs : 1;
+    wake(c,CondB,1); /* so sleeping receivers start over with the new settings */
+    unlock(c);
+}
+
+void CspChan_stats(CspChan_t* c, CspChan_Stats* stats)
+{
+    memset(stats,0,sizeof(CspChan_Stats));
+    if( c->sharded )
+    {
+        Shards* sh = (Shards*)c->data;
+        unsigned int i;
+        for( i = 0; i < sh->count; i++ )
+        {
+            CspChan_Stats s;
+            CspChan_stats(sh->shard[i], &s);
+            stats->overwritten += s.overwritten;
+            stats->dropped += s.dropped;
+            stats->replaced += s.replaced;
+            stats->shed += s.shed;
+            stats->diverted += s.diverted;
+            stats->grown += s.grown;
+            stats->blockedSends += s.blockedSends;
+            stats->blockedReceives += s.blockedReceives;
+            stats->tunedUp += s.tunedUp;
+            stats->tunedDown += s.tunedDown;
+            stats->queueLen += s.queueLen;
+        }
+        return;
+    }
+    lock(c);
+    if( c->w && c->w->counters )
+        *stats = *c->w->counters;
+    stats->queueLen = c->unbuffered ? 0 : c->queueLen;
+    unlock(c);
+}
+
+unsigned int CspChan_latest(CspChan_t* c, void* dataPtr)
+{
+    if( c->unbuffered || c->fused || c->fullPolicy != FullConflate )
+        return 0;
+    for(;;)
+    {
+        const unsigned int before = c->seq;
+        __sync_synchronize();
+        if( before == 0 )
+            return 0;
+        if( before & 1 )
+        {
+            sched_yield(); /* a send is writing the slot */
+            continue;
+        }
+        /* the slot may be overwritten while we copy it; this is detected below and the copy repeated */
+        memcpy(dataPtr, (const unsigned char*)c->data, c->msgLen);
+        __sync_synchronize();
+        if( c->seq == before )
+            return before / 2;
+    }
+}
+
+void CspChan_aqm(CspChan_t* c, unsigned int targetUs, unsigned int intervalUs, CspChan_t* divert)
+{
+    if( c->unbuffered || c->fused || c->sharded || c->lazy || c->order != RingOrder )
+        return;
+    lock(c);
+    Waiters* w = waiters(c);
+    if( targetUs == 0 )
+    {
+        free(w->aqm);
+        w->aqm = 0;
+    }else
+    {
+        if( w->aqm == 0 )
+        {
+            /* indexed like the ring, which has more than queueLen slots if it is mirrored */
+            Codel* q = (Codel*)malloc(sizeof(Codel) + c->cap * sizeof(unsigned int));
+            memset(q, 0, sizeof(Codel));
+            q->enqueued = (unsigned int*)(q + 1);
+            /* the messages already buffered count as sent now */
+            const unsigned int now = now_us();
+            unsigned int i;
+            for( i = 0; i < c->cap; i++ )
+                q->enqueued[i] = now;
+            w->aqm = q;
+        }
+        w->aqm->target = targetUs;
+        w->aqm->interval = intervalUs ? intervalUs : 1;
+        w->aqm->divert = divert;
+    }
+    unlock(c);
+}
+
+int CspChan_resize(CspChan_t* c, unsigned short queueLen)
+{
+    if( c->sharded )
+    {
+        Shards* sh = (Shards*)c->data;
+        unsigned int i;
+        int res = 1;
+        for( i = 0; i < sh->count; i++ )
+            res = CspChan_resize(sh->shard[i], (queueLen + sh->count - 1) / sh->count) && res;
+        lock(c);
+        if( res )
+            c->queueLen = queueLen;
+        unlock(c);
+        return res;
+    }
+    lock(c);
+    const int more = queueLen > c->queueLen;
+    const int res = relocate_queue(c, queueLen);
+    if( res && more )
+    {
+        signal_all(c);
+        wake(c,CondA,1);
+    }
+    unlock(c);
+    return res;
+}
+
+void CspChan_autotune(CspChan_t* c, unsigned short minLen, unsigned short maxLen, unsigned int targetPermille)
+{
+    lock(c);
+    if( !growable(c) )
+    {
+        unlock(c);
+        return;
+    }
+    Waiters* w = waiters(c);
+    if( maxLen == 0 )
+    {
+        free(w->tune);
+        w->tune = 0;
+    }else
+    {
+        if( w->tune == 0 )
+            w->tune = (Tuning*)malloc(sizeof(Tuning));
+        Tuning* t = w->tune;
+        t->minLen = minLen ? minLen : 1;
+        t->maxLen = maxLen < t->minLen ? t->minLen : maxLen;
+        t->target = targetPermille;
+        t->sends = 0;
+        t->peak = c->msgCount;
+        t->blockedAtStart = counters(w)->blockedSends;
+    t->starvedAtStart = counters(w)->blockedReceives;
+        /* start within the bounds */
+        if( c->queueLen < t->minLen )
+            relocate_queue(c, t->minLen);
+        else if( c->queueLen > t->maxLen && c->msgCount <= t->maxLen )
+            relocate_queue(c, t->maxLen);
+    }
+    unlock(c);
+}
+
+unsigned short CspChan_msgLen(CspChan_t* c)
+{
+    return c->msgLen;
+}
@@ -50,6 +50,136 @@ typedef struct CspChan_t CspChan_t;
  * Channels are thread-safe and thus can safely be passed to and used by other threads in parallel. */
 CSPCHANEXP CspChan_t* CspChan_create(unsigned short queueLen, unsigned short msgLen );
 
+/* Flags for CspChan_create_ex; they only apply to buffered channels. */
+enum CspChan_Flags {
+    CspChan_HugePages = 1, /* back the ring buffer with huge pages; falls back to normal pages if none available */
+    CspChan_Prefault = 2, /* touch all pages of the ring buffer on creation, so no page faults occur on send */
+    CspChan_Locked = 4, /* lock the pages of the ring buffer in memory (if permitted by RLIMIT_MEMLOCK) */
+    CspChan_Mirrored = 8, /* map the ring buffer twice in a row, so batches never have to be split at the wrap point */
+    CspChan_Compact = 16, /* minimal memory footprint for large numbers of mostly idle channels */
+    CspChan_Lazy = 32, /* the ring buffer grows and shrinks with the number of buffered messages */
+    CspChan_NonTemporal = 64, /* messages of 4 KB or more are written to the ring buffer bypassing the cache */
+    CspChan_Sharded = 128, /* many senders, one receiver: one sub-queue per CPU instead of one contended lock */
+    CspChan_OverwriteOldest = 256, /* a send to a full channel discards the oldest message instead of blocking */
+    CspChan_DropNewest = 512, /* a send to a full channel discards the message sent instead of blocking */
+    CspChan_Conflate = 1024 /* the channel only keeps the latest message; see CspChan_latest */
+};
+
+/* CspChan_create_ex:
+ * Same as CspChan_create, but the ring buffer storage can be configured using a combination of
+ * CspChan_Flags. Any of these flags causes the ring buffer to be allocated by mmap separately from the
+ * channel instead of together with it, which pays off for large channels streaming a lot of data.
+ * CspChan_HugePages first tries explicit huge pages (MAP_HUGETLB) and then transparent huge pages
+ * (MADV_HUGEPAGE). CspChan_Mirrored maps the same memory twice contiguously (on systems with memfd_create),
+ * so any run of up to queueLen messages is one contiguous span; the ring is rounded up to whole pages for
+ * this purpose, and if this would waste too much memory a normal ring is used instead.
+ * CspChan_Compact creates a channel of about 40 bytes (on 64 bit Linux) instead of the few hundred bytes
+ * of a normal one (see CspChan_sizeof); it uses a spin lock word instead of a mutex, and allocates the mutexes and condition variables only when
+ * a thread has to wait for the first time, and the ring buffer only with the first message sent. Compact
+ * channels behave the same as normal ones, but are less suited for heavily contended channels.
+ * CspChan_Lazy allocates the ring buffer with the first message sent, doubles it whenever it is full,
+ * up to queueLen, and halves it when it is less than a quarter full; a receiver which waits on an empty
+ * channel for a second releases the ring buffer. Thus the memory used by the channel follows the number
+ * of buffered messages rather than queueLen; CspChan_Lazy is ignored for mmapped ring buffers. Note that
+ * the smallest ring buffer is only released by a waiting receiver; an empty channel which nobody
+ * receives from (or which is only used with select or CspChan_nb_select) keeps it until the next receive
+ * waits on it, or until it is disposed.
+ * CspChan_NonTemporal uses streaming stores (SSE2) for large messages, so the sender doesn't evict its own
+ * working set from the cache; this pays off if the receiver runs on another core or socket and lags behind,
+ * but costs throughput if both share a cache.
+ * CspChan_Sharded creates a fan-in channel for many senders and one (or few) receivers. It consists of one
+ * buffered sub-channel of queueLen/CPUs messages per CPU (at least four) (combined with the other flags); the senders are
+ * spread evenly over the sub-channels, each one always using the same, so they contend for a lock only with
+ * few others and the messages of a sender stay in order. The receiver drains the sub-channels round-robin;
+ * for receive and select the channel behaves as one.
+ * CspChan_OverwriteOldest, CspChan_DropNewest and CspChan_Conflate make the channel lossy, e.g. for
+ * telemetry where a blocked producer is worse than a lost sample: a sender never blocks, and a send case
+ * of a select is always ready. The messages lost are counted (see CspChan_stats). CspChan_Conflate is
+ * CspChan_OverwriteOldest with a queueLen of 1, and additionally lets any number of threads read the
+ * latest message without taking it from the channel (see CspChan_latest); CspChan_Lazy, CspChan_Sharded
+ * and the flags of a mapped ring buffer are ignored in this case.
+ * Returns NULL if the ring buffer could not be allocated. */
+CSPCHANEXP CspChan_t* CspChan_create_ex(unsigned short queueLen, unsigned short msgLen, unsigned int flags);
+
+/* CspChan_create_keyed:
+ * Creates a buffered channel which keeps at most one message per key, e.g. for state updates where only
+ * the latest value of each symbol or device matters. The key is the first keyLen bytes of a message. A
+ * message whose key is not yet in the channel is appended as usual; a message whose key is still waiting
+ * to be received replaces the older one in place, keeping its position (counted as replaced by
+ * CspChan_stats). Thus queueLen is the number of distinct keys which can be pending, a sender only blocks
+ * if queueLen other keys are pending, and a slow receiver never works through a stale backlog. The keys
+ * are looked up in a hash table of about 4 * queueLen bytes. Returns NULL if queueLen or keyLen is 0 or
+ * keyLen exceeds msgLen. */
+CSPCHANEXP CspChan_t* CspChan_create_keyed(unsigned short queueLen, unsigned short msgLen, unsigned short keyLen);
+
+/* CspChan_create_priority:
+ * Creates a buffered channel whose messages start with an int priority; a receive always returns the
+ * message with the highest priority, and messages of equal priority are received in the order they were
+ * sent. Otherwise the channel behaves like one created by CspChan_create, i.e. it blocks and can be used
+ * in a select the same way. The messages stay where they were written in the ring buffer, and only their
+ * slot numbers are ordered in a 4-ary heap, so send and receive take O(log queueLen) without moving
+ * messages. Returns NULL if queueLen is 0 or msgLen is smaller than an int. */
+CSPCHANEXP CspChan_t* CspChan_create_priority(unsigned short queueLen, unsigned short msgLen);
+
+/* CspChan_create_delayed:
+ * Creates a buffered channel for messages which are only to be received at a due time, e.g. for retries
+ * with backoff. Messages are sent by CspChan_send_delayed; a message sent by CspChan_send or a select is
+ * due immediately. Receivers get the messages in the order of their due times (those with the same due
+ * time in the order sent), and a receiver waiting on the channel wakes up by itself when the first message
+ * is due; select does the same. Thus pending messages cost no thread, only their slot in the channel;
+ * up to queueLen messages can be pending, and a sender blocks as long as the channel is full. The due
+ * times have millisecond resolution. CspChan_async_select is only notified by sends, i.e. it cannot wait
+ * for a message to become due. Returns NULL if queueLen is 0. */
+CSPCHANEXP CspChan_t* CspChan_create_delayed(unsigned short queueLen, unsigned short msgLen);
+
+/* CspChan_send_delayed:
+ * Sends the message to a channel created by CspChan_create_delayed, where it can be received in delayMs
+ * milliseconds. For other channels, this is the same as CspChan_send. */
+CSPCHANEXP void CspChan_send_delayed(CspChan_t*, void* dataPtr, unsigned int delayMs);
+
+/* CspChan_sizeof:
+ * Returns the number of bytes required by CspChan_init for a channel with the given parameters.
+ * CSPCHAN_SIZEOF_MAX is a compile time upper bound of CspChan_sizeof, e.g. for static or stack storage;
+ * the header part is checked when compiling CspChan.c. */
+CSPCHANEXP unsigned int CspChan_sizeof(unsigned short queueLen, unsigned short msgLen);
+#define CSPCHAN_MAX_HEADER 512
+#define CSPCHAN_SIZEOF_MAX(queueLen, msgLen) (CSPCHAN_MAX_HEADER + (queueLen) * ((msgLen) ? (msgLen) : 1))
+
+/* CspChan_init:
+ * Same as CspChan_create, but the channel is constructed in the memory provided by the caller instead
+ * of allocating it. mem must be at least CspChan_sizeof(queueLen, msgLen) bytes and aligned as for
+ * malloc. This allows to embed channels in other structs, arenas or on the stack. Returns the channel,
+ * which is located at mem. */
+CSPCHANEXP CspChan_t* CspChan_init(void* mem, unsigned short queueLen, unsigned short msgLen);
+
+/* CspChan_deinit:
+ * Counterpart of CspChan_init; closes the channel and releases its resources, but not the memory
+ * provided to CspChan_init, which can be reused or freed by the caller after the call. CspChan_dispose
+ * can also be used for channels created by CspChan_init; it calls CspChan_deinit in this case. */
+CSPCHANEXP void CspChan_deinit(CspChan_t*);
+
+/* CspChan_Transform:
+ * The function of a fused channel; it computes the out message from the in message and returns 1, or
+ * returns 0 if the message is to be dropped (i.e. a filter). ctx is the value passed to CspChan_fuse. */
+typedef int (*CspChan_Transform)(void* ctx, const void* in, void* out);
+
+/* CspChan_fuse:
+ * Creates a channel which accepts messages of msgLen bytes, transforms them by calling fn in the thread
+ * of the sender and sends the result (of the message size of downstream) to downstream. Thus a stage
+ * which maps or filters messages doesn't need a thread of its own nor a channel hop; downstream can itself
+ * be a fused channel, so a chain of stages runs in the sender's call stack, and the sender blocks as long
+ * as the last channel of the chain is full. If more than one thread sends to the channel, fn must be
+ * thread-safe. Closing or disposing the fused channel doesn't affect downstream. A fused channel cannot
+ * be used to receive, nor in a select. */
+CSPCHANEXP CspChan_t* CspChan_fuse(CspChan_t* downstream, unsigned short msgLen, CspChan_Transform fn, void* ctx);
+
+/* CspChan_fuse_receive:
+ * The counterpart of CspChan_fuse on the receive side; a receive from the created channel receives
+ * from upstream and transforms the message to msgLen bytes by calling fn in the thread of the receiver,
+ * repeatedly until fn accepts a message or upstream is closed. A fused channel cannot be used to send,
+ * nor in a select. */
+CSPCHANEXP CspChan_t* CspChan_fuse_receive(CspChan_t* upstream, unsigned short msgLen, CspChan_Transform fn, void* ctx);
+
 /* CspChan_close:
  * The call to CspChan_close is optional; it is useful to signal to a thread that it should stop
  * running without an extra channel. It is legal though to directly call CspChan_dispose when
@@ -61,6 +191,98 @@ CSPCHANEXP void CspChan_close(CspChan_t*);
  * returns 1, otherwise 0. */
 CSPCHANEXP int CspChan_closed(CspChan_t*);
 
+/* CspChan_coalesce:
+ * Reduces the wakeups of a receiver of a buffered channel, similar to interrupt coalescing of network
+ * cards: a receiver sleeping in CspChan_receive/receive_n on the empty channel is only woken by the
+ * senders when minCount messages are queued (or the channel is full); otherwise it wakes up by itself
+ * after at most maxDelayMs milliseconds and takes whatever has arrived. Thus no message waits longer than
+ * maxDelayMs for a sleeping receiver, but an idle receiver wakes up every maxDelayMs. A receiver which
+ * finds messages doesn't wait at all, and select is notified as before. minCount <= 1 switches coalescing
+ * off again. Not supported for unbuffered, fused and sharded channels. */
+CSPCHANEXP void CspChan_coalesce(CspChan_t*, unsigned short minCount, unsigned int maxDelayMs);
+
+/* CspChan_resolve_deadlocks:
+ * Switches the artificial deadlock resolution for Kahn process networks on (on != 0) or off. Bounded
+ * buffers can make a process network stall although it would make progress with larger ones, e.g. if a
+ * producer fills one channel while its consumer waits on another. When on, the library keeps track of the
+ * agents started by CspChan_fork and the calling thread; if all of them are blocked in channel operations
+ * (including select) for 10 ms, and at least one waits to send to a full buffered channel, the queueLen of
+ * the smallest such channel is doubled (Parks' algorithm), so the network gets along with the minimal
+ * buffering needed. The enlargements are counted by CspChan_stats. Only plain buffered channels (not
+ * unbuffered, fused, sharded, conflating or those of CspChan_create_keyed, _priority and _delayed) can be
+ * grown, and queueLen cannot exceed 65535. The mode must be switched on before the agents are forked, and
+ * all threads which use the channels of the network must be agents, since otherwise a waiting agent could
+ * be mistaken for a stalled one or vice versa. */
+CSPCHANEXP void CspChan_resolve_deadlocks(int on);
+
+/* CspChan_resize:
+ * Changes the queueLen of a live buffered channel, e.g. to absorb a traffic spike. The ring buffer is
+ * reallocated with the buffered messages moved to its start in order; this happens with the channel
+ * locked, so senders and receivers only wait for the copy. If queueLen grows, blocked senders continue.
+ * queueLen cannot be less than the number of messages buffered at the time of the call. For a sharded
+ * channel each sub-channel is resized to its share. Returns 1 on success, or 0 if queueLen is too small or
+ * 0, or the channel cannot be resized (see CspChan_resolve_deadlocks); a sharded channel may be resized
+ * partly in this case. */
+CSPCHANEXP int CspChan_resize(CspChan_t*, unsigned short queueLen);
+
+/* CspChan_autotune:
+ * Lets the channel choose its queueLen between minLen and maxLen by itself, instead of guessing it at
+ * creation. The channel counts the sends which have to wait because it is full; after every 256 messages
+ * it doubles queueLen if more than targetPermille of them had to wait, and halves it if less than half of
+ * that many had to wait and at most half of queueLen was used, so the memory and the latency stay as low
+ * as the target allows. The receives which have to wait because the channel is empty are counted too; if
+ * they are more than half of the messages, the channel is mostly empty and a larger buffer wouldn't help,
+ * so queueLen is not doubled, and it is halved even if more of it was used in a burst. The waits on both
+ * sides and the decisions are counted by CspChan_stats, which also reports the current queueLen. A maxLen of 0 switches the tuning off again, keeping the current
+ * queueLen. Only supported for channels which CspChan_resolve_deadlocks can grow. */
+CSPCHANEXP void CspChan_autotune(CspChan_t*, unsigned short minLen, unsigned short maxLen, unsigned int targetPermille);
+
+/* CspChan_aqm:
+ * Switches on active queue management for a buffered channel, so an overloaded channel doesn't sit full
+ * with every message waiting for the whole queue; this keeps the latency bounded without reducing
+ * queueLen. The channel records when each message was sent, and works as CoDel (RFC 8289) when a message
+ * is received: as soon as the time messages spend in the channel has stayed above targetUs microseconds
+ * for intervalUs microseconds (e.g. 5000 and 100000), messages are taken from the head of the channel and
+ * shed instead of received, at a rate increasing with the square root of the number shed, until the
+ * delay falls below targetUs again. The last message in the channel is never shed. Shed messages are sent
+ * to divert if it is not NULL and ready (e.g. a buffered channel with room, or a receiver waiting), and
+ * dropped otherwise; they are counted by CspChan_stats. divert must be another channel. A targetUs of 0
+ * switches the management off again. Not supported for unbuffered, fused, sharded and lazy channels,
+ * and for those created by CspChan_create_keyed, CspChan_create_priority or CspChan_create_delayed. */
+CSPCHANEXP void CspChan_aqm(CspChan_t*, unsigned int targetUs, unsigned int intervalUs, CspChan_t* divert);
+
+typedef struct CspChan_Stats
+{
+    unsigned long overwritten; /* messages discarded by CspChan_OverwriteOldest or CspChan_Conflate */
+    unsigned long dropped; /* messages discarded by CspChan_DropNewest */
+    unsigned long replaced; /* messages replaced by a newer one with the same key (see CspChan_create_keyed) */
+    unsigned long shed; /* messages dropped by CspChan_aqm */
+    unsigned long diverted; /* messages sent to the divert channel by CspChan_aqm */
+    unsigned long grown; /* times queueLen was doubled by CspChan_resolve_deadlocks */
+    unsigned long blockedSends; /* sends (send, send_n) which had to wait because the channel was full */
+    unsigned long blockedReceives; /* receives (receive, receive_n) which had to wait because the channel was empty */
+    unsigned long tunedUp; /* times queueLen was doubled by CspChan_autotune */
+    unsigned long tunedDown; /* times queueLen was halved by CspChan_autotune */
+    unsigned short queueLen; /* the current queueLen */
+} CspChan_Stats;
+
+/* CspChan_stats:
+ * Copies the counters of the channel to stats; for a sharded channel, the counters of the sub-channels are
+ * summed up. */
+CSPCHANEXP void CspChan_stats(CspChan_t*, CspChan_Stats* stats);
+
+/* CspChan_latest:
+ * Copies the latest message sent to a CspChan_Conflate channel to dataPtr, whether it was already received
+ * or not, and returns the number of messages sent so far, i.e. a version number; returns 0 and leaves
+ * dataPtr untouched if nothing was sent yet or the channel is not a CspChan_Conflate channel. The message
+ * is read without locking the channel: a sequence lock detects a concurrent send, in which case the read
+ * is repeated, so readers never delay the sender. */
+CSPCHANEXP unsigned int CspChan_latest(CspChan_t*, void* dataPtr);
+
+/* CspChan_msgLen:
+ * Returns the size of the messages transported by the channel, i.e. msgLen (or 1 if it was 0). */
+CSPCHANEXP unsigned short CspChan_msgLen(CspChan_t*);
+
 /* CspChan_dispose:
  * Delete a channel which was created by CspChan_create earlier. This procedure also signals all threads
  * waiting on this channel. After the call the channel pointer is invalid. */
@@ -80,6 +302,19 @@ CSPCHANEXP void CspChan_send(CspChan_t*, void* dataPtr);
  * with no effect. The parameter dataPtr is the address of the variable which receives the data. */
 CSPCHANEXP void CspChan_receive(CspChan_t*, void* dataPtr);
 
+/* CspChan_send_n:
+ * Send count messages of msgLen bytes each, which are stored consecutively at dataPtr. The messages are
+ * copied into the buffer in as few steps as possible, blocking as long as the channel is full. Returns the
+ * number of messages sent, which is less than count only if the channel was closed meanwhile. */
+CSPCHANEXP unsigned int CspChan_send_n(CspChan_t*, void* dataPtr, unsigned int count);
+
+/* CspChan_receive_n:
+ * Receive up to count messages of msgLen bytes each into consecutive memory at dataPtr. The call blocks
+ * until at least one message is available and then takes as many as are buffered (at most count).
+ * Unbuffered channels deliver one message per call. Returns the number of messages received, or 0 if the
+ * channel was closed. */
+CSPCHANEXP unsigned int CspChan_receive_n(CspChan_t*, void* dataPtr, unsigned int count);
+
 /* CspChan_select:
  * This function works like the select statement (without default) of the Go programming language.
  * It accepts an array of receiver channels and receiver variable addresses of length rCount and an
@@ -108,6 +343,71 @@ CSPCHANEXP int CspChan_select(CspChan_t** receiver, void** rData, unsigned int r
 CSPCHANEXP int CspChan_nb_select(CspChan_t** receiver, void** rData, unsigned int rCount,
                         CspChan_t** sender, void** sData, unsigned int sCount );
 
+/* CspChan_timed_select:
+ * Same as CspChan_select, but waits at most the given number of milliseconds for a channel to become
+ * ready; if none did, the function returns -1 (as CspChan_nb_select does; use CspChan_closed to tell
+ * a timeout from closed channels). */
+CSPCHANEXP int CspChan_timed_select(CspChan_t** receiver, void** rData, unsigned int rCount,
+                        CspChan_t** sender, void** sData, unsigned int sCount, unsigned int milliseconds );
+
+
+/* Asynchronous API, e.g. for coroutines or event loops which must not block a thread. */
+
+/* CspChan_Job:
+ * A unit of work run by the worker pool of the library; see CspChan_post. The caller owns the memory,
+ * which must stay valid until run is called; next is used by the pool. */
+typedef struct CspChan_Job {
+    void (*run)(struct CspChan_Job*);
+    struct CspChan_Job* next;
+} CspChan_Job;
+
+/* CspChan_Waiter:
+ * A waiter record which is linked into a channel and notified whenever the state of the channel changes.
+ * The caller owns the memory; the fields are set by the library. */
+typedef struct CspChan_Waiter {
+    void (*notify)(struct CspChan_Waiter*);
+    void* ctx;
+    CspChan_t* chan;
+    struct CspChan_Waiter* prev;
+    struct CspChan_Waiter* next;
+} CspChan_Waiter;
+
+/* CspChan_Async:
+ * The state of an asynchronous select; the caller sets the channel and data arrays as for CspChan_select,
+ * done, and waiter, which must point to rCount+sCount waiter records. The other fields are private. */
+typedef struct CspChan_Async {
+    CspChan_Job job;
+    CspChan_t** receiver;
+    void** rData;
+    unsigned int rCount;
+    CspChan_t** sender;
+    void** sData;
+    unsigned int sCount;
+    CspChan_Waiter* waiter;
+    void (*done)(struct CspChan_Async*, int result);
+    volatile int state;
+} CspChan_Async;
+
+enum { CspChan_Pending = -2 };
+
+/* CspChan_async_select:
+ * Works like CspChan_select, but instead of blocking the calling thread, it returns CspChan_Pending
+ * if none of the channels is ready. The operation then waits in the waiter records linked into the
+ * channels, and as soon as one of them is ready, the worker pool completes the operation and calls done
+ * with the same result CspChan_select would return. If the operation can be completed immediately, the
+ * result is returned and done is not called. No memory is allocated besides what the caller provides.
+ * An unbuffered channel is only ready for an asynchronous operation if a thread is blocked in
+ * CspChan_send/receive on the other side, i.e. two asynchronous operations never meet on an unbuffered
+ * channel; use buffered channels between coroutines. The channels must not be disposed while the
+ * operation is pending. */
+CSPCHANEXP int CspChan_async_select(CspChan_Async*);
+
+/* CspChan_post:
+ * Runs the job on one of the worker threads of the library. Up to one worker per online CPU is created
+ * on demand; the workers live until the process ends. Jobs must not block for long, since they delay
+ * all other jobs waiting for a worker. */
+CSPCHANEXP void CspChan_post(CspChan_Job*);
+
 
 /* Helper API for applications which don't want to directly deal with a thread API. */
 
@@ -121,6 +421,22 @@ CSPCHANEXP int CspChan_fork(void* (*agent)(void*), void * arg);
  * Suspends the calling thread for the given number of milliseconds. */
 CSPCHANEXP void CspChan_sleep(unsigned int milliseconds);
 
+/* CspChan_simulate:
+ * Switches the simulation mode on (on != 0) or off. In this mode CspChan_sleep, the timeouts of
+ * CspChan_timed_select and the other timed operations, the due times of delayed messages and the delays of
+ * CspChan_coalesce and CspPipe_batch refer to a simulated clock instead of the real one. The clock starts
+ * at the real time, and it jumps forward to the next due time as soon as all agents have been blocked for
+ * a millisecond of real time, so timing-heavy code runs in a fraction of its real duration but in the
+ * same order of events. The agents are tracked as with CspChan_resolve_deadlocks: the mode must be switched
+ * on before the agents are forked, and all threads which use the channels must be agents. CoDel (see
+ * CspChan_aqm) keeps measuring real time. */
+CSPCHANEXP void CspChan_simulate(int on);
+
+/* CspChan_now:
+ * Returns the current time in milliseconds since the epoch, or the simulated time (see CspChan_simulate);
+ * a double, since C89 has no 64 bit integer type, which represents whole milliseconds exactly. */
+CSPCHANEXP double CspChan_now(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,393 @@
+#ifndef CSP_CHANNEL_HPP
+#define CSP_CHANNEL_HPP
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file may be used under the terms of the GNU Lesser
+* General Public License version 2.1 or version 3 as published by the Free
+* Software Foundation and appearing in the file LICENSE.LGPLv21 and
+* LICENSE.LGPLv3 included in the packaging of this file. Please review the
+* following information to ensure the GNU Lesser General Public License
+* requirements will be met: https://www.gnu.org/licenses/lgpl.html and
+* http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+*
+* Alternatively this file may be used under the terms of the Mozilla
+* Public License. If a copy of the MPL was not distributed with this
+* file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+/* CspChan.hpp:
+ * A header-only, typed C++11 wrapper of the CspChan C API. Chan<T,Capacity> is a channel of T with
+ * Capacity buffered messages (0 means unbuffered, as in CspChan_create). The channel lives inside the
+ * Chan object (see CspChan_init), so no heap allocation is involved in creating it, and the message
+ * size is a compile time constant.
+ * Trivially copyable T are copied into the channel as they are. Other T are moved into a heap allocated
+ * box, and only the pointer to the box travels through the channel; boxes which are still in the channel
+ * when it is closed or destroyed are deleted by the Chan destructor.
+ * Csp::select and Csp::nb_select accept any number of Csp::recv(chan,var) and Csp::send(chan,value)
+ * cases and return the index of the case which was selected (in argument order) or -1.
+ * With C++20, the cases can also be awaited in a coroutine: co_await Csp::recv(chan,var) and
+ * co_await Csp::send(chan,value) return false if the channel was closed, and co_await Csp::async_select(...)
+ * returns the same as Csp::select. Instead of blocking, the coroutine is suspended in the waiter records
+ * of the channels (see CspChan_async_select) and resumed on a thread of the library's worker pool; the
+ * awaiter lives in the coroutine frame, so no other memory is allocated. Two coroutines cannot communicate
+ * over an unbuffered channel; one side has to be a thread. */
+
+#include "CspChan.h"
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Csp
+{
+    namespace detail
+    {
+        template<class T>
+        struct IsBoxed : std::integral_constant<bool, !std::is_trivially_copyable<T>::value> {};
+
+        struct Box
+        {
+            Box* prev;
+            Box* next;
+        };
+
+        template<class T>
+        struct BoxOf : Box
+        {
+            T value;
+            template<class U>
+            explicit BoxOf(U&& u):value(std::forward<U>(u)) {}
+        };
+
+        /* keeps track of the boxes owned by a channel, so those lost by closing it can be deleted */
+        template<class T, bool boxed = IsBoxed<T>::value>
+        class Boxes
+        {
+        public:
+            typedef T Message;
+            template<class U>
+            static Message make(U&& v) { return Message(std::forward<U>(v)); }
+            static void take(Message& m, T& to) { to = m; }
+            static void discard(Message&) {}
+        };
+
+        template<class T>
+        class Boxes<T, true>
+        {
+        public:
+            typedef BoxOf<T>* Message;
+            Boxes() { head.prev = head.next = &head; }
+            ~Boxes()
+            {
+                while( head.next != &head )
+                {
+                    Message m = static_cast<Message>(head.next);
+                    discard(m);
+                }
+            }
+            template<class U>
+            Message make(U&& v)
+            {
+                Message m = new BoxOf<T>(std::forward<U>(v));
+                std::lock_guard<std::mutex> guard(lock);
+                m->prev = &head;
+                m->next = head.next;
+                head.next->prev = m;
+                head.next = m;
+                return m;
+            }
+            void take(Message& m, T& to)
+            {
+                to = std::move(m->value);
+                discard(m);
+            }
+            void discard(Message& m)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    m->prev->next = m->next;
+                    m->next->prev = m->prev;
+                }
+                delete m;
+                m = 0;
+            }
+        private:
+            std::mutex lock;
+            Box head;
+        };
+
+        template<class Case>
+        struct CaseTraits;
+    }
+
+    template<class T, unsigned short Capacity = 0>
+    class Chan
+    {
+    public:
+        typedef T Value;
+        typedef detail::Boxes<T> Boxes;
+        typedef typename Boxes::Message Message;
+        static const unsigned short MsgLen = sizeof(Message);
+
+        Chan():c(CspChan_init(mem, Capacity, MsgLen)) {}
+        ~Chan() { CspChan_deinit(c); }
+
+        void send(const T& v) { send_message(boxes.make(v)); }
+        void send(T&& v) { send_message(boxes.make(std::move(v))); }
+
+        /* returns false if the channel was closed */
+        bool recv(T& v)
+        {
+            Message m;
+            if( CspChan_receive_n(c, &m, 1) == 0 )
+                return false;
+            boxes.take(m, v);
+            return true;
+        }
+        T recv()
+        {
+            T v = T();
+            recv(v);
+            return v;
+        }
+
+        void close() { CspChan_close(c); }
+        bool closed() const { return CspChan_closed(c) != 0; }
+        CspChan_t* handle() const { return c; }
+
+        /* used by the select cases */
+        Boxes& box_list() { return boxes; }
+    private:
+        Chan(const Chan&);
+        Chan& operator=(const Chan&);
+        void send_message(Message m)
+        {
+            /* if the channel is closed, a boxed message stays in the box list until the destructor */
+            CspChan_send(c, &m);
+        }
+
+        union
+        {
+            unsigned char mem[CSPCHAN_SIZEOF_MAX(Capacity, MsgLen)];
+            std::max_align_t align;
+        };
+        CspChan_t* c;
+        Boxes boxes;
+    };
+
+    template<class Ch>
+    struct RecvCase
+    {
+        Ch& ch;
+        typename Ch::Value& to;
+        typename Ch::Message msg;
+        RecvCase(Ch& c, typename Ch::Value& v):ch(c),to(v),msg() {}
+        void finish(bool selected)
+        {
+            if( selected )
+                ch.box_list().take(msg, to);
+        }
+    };
+
+    template<class Ch>
+    struct SendCase
+    {
+        Ch& ch;
+        typename Ch::Message msg;
+        template<class U>
+        SendCase(Ch& c, U&& v):ch(c),msg(c.box_list().make(std::forward<U>(v))) {}
+        void finish(bool selected)
+        {
+            if( !selected )
+                ch.box_list().discard(msg);
+        }
+    };
+
+    template<class Ch>
+    RecvCase<Ch> recv(Ch& ch, typename Ch::Value& to) { return RecvCase<Ch>(ch, to); }
+
+    template<class Ch, class U>
+    SendCase<Ch> send(Ch& ch, U&& v) { return SendCase<Ch>(ch, std::forward<U>(v)); }
+
+    namespace detail
+    {
+        template<class Ch>
+        struct CaseTraits< RecvCase<Ch> > { enum { isSend = 0 }; };
+        template<class Ch>
+        struct CaseTraits< SendCase<Ch> > { enum { isSend = 1 }; };
+
+        template<unsigned N>
+        struct Selection
+        {
+            CspChan_t* receiver[N];
+            void* rData[N];
+            unsigned int rCount;
+            CspChan_t* sender[N];
+            void* sData[N];
+            unsigned int sCount;
+            int index[N]; /* the CspChan_select index of each argument; senders are offset by rCount later */
+            unsigned int argCount;
+            Selection():rCount(0),sCount(0),argCount(0) {}
+
+            template<class Case>
+            int add(Case& c)
+            {
+                if( CaseTraits<Case>::isSend )
+                {
+                    index[argCount++] = -1 - (int)sCount;
+                    sender[sCount] = c.ch.handle();
+                    sData[sCount++] = &c.msg;
+                }else
+                {
+                    index[argCount++] = (int)rCount;
+                    receiver[rCount] = c.ch.handle();
+                    rData[rCount++] = &c.msg;
+                }
+                return 0;
+            }
+            int argument(int selected) const
+            {
+                unsigned int i;
+                if( selected < 0 )
+                    return -1;
+                for( i = 0; i < N; i++ )
+                {
+                    const int n = index[i] < 0 ? (int)rCount - 1 - index[i] : index[i];
+                    if( n == selected )
+                        return (int)i;
+                }
+                return -1;
+            }
+        };
+
+        template<unsigned N, class... Cases>
+        int run_select(bool blocking, Cases&... cases)
+        {
+            Selection<N> sel;
+            int added[] = { sel.add(cases)... };
+            (void)added;
+            const int n = blocking ?
+                        CspChan_select(sel.receiver, sel.rData, sel.rCount, sel.sender, sel.sData, sel.sCount) :
+                        CspChan_nb_select(sel.receiver, sel.rData, sel.rCount, sel.sender, sel.sData, sel.sCount);
+            const int res = sel.argument(n);
+            int i = 0;
+            int finished[] = { (cases.finish(res == i++), 0)... };
+            (void)finished;
+            return res;
+        }
+    }
+
+    /* blocks until one of the cases is ready; returns the argument index of the selected case or -1 if
+       all channels are closed */
+    template<class... Cases>
+    int select(Cases&&... cases)
+    {
+        return detail::run_select<sizeof...(Cases)>(true, cases...);
+    }
+
+    /* like select, but returns -1 immediately if no case is ready */
+    template<class... Cases>
+    int nb_select(Cases&&... cases)
+    {
+        return detail::run_select<sizeof...(Cases)>(false, cases...);
+    }
+}
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+#include <coroutine>
+#include <tuple>
+
+namespace Csp
+{
+    namespace detail
+    {
+        template<class... Cases>
+        class SelectAwaiter
+        {
+        public:
+            explicit SelectAwaiter(Cases... c):cases(std::move(c)...),result(-1) { async.self = this; }
+            SelectAwaiter(const SelectAwaiter&) = delete;
+            SelectAwaiter& operator=(const SelectAwaiter&) = delete;
+
+            bool await_ready() const { return false; }
+            bool await_suspend(std::coroutine_handle<> h)
+            {
+                handle = h;
+                std::apply([this](Cases&... c) { int added[] = { sel.add(c)... }; (void)added; }, cases);
+                CspChan_Async& op = async.op;
+                op.receiver = sel.receiver;
+                op.rData = sel.rData;
+                op.rCount = sel.rCount;
+                op.sender = sel.sender;
+                op.sData = sel.sData;
+                op.sCount = sel.sCount;
+                op.waiter = waiter;
+                op.done = done;
+                const int n = CspChan_async_select(&op);
+                if( n == CspChan_Pending )
+                    return true;
+                result = n;
+                return false;
+            }
+            int await_resume()
+            {
+                const int res = sel.argument(result);
+                int i = 0;
+                std::apply([res, &i](Cases&... c) { int finished[] = { (c.finish(res == i++), 0)... }; (void)finished; },
+                           cases);
+                return res;
+            }
+        private:
+            static void done(CspChan_Async* op, int n)
+            {
+                SelectAwaiter* self = reinterpret_cast<Async*>(op)->self;
+                self->result = n;
+                self->handle.resume();
+            }
+
+            struct Async
+            {
+                CspChan_Async op; /* first, so done can find the awaiter */
+                SelectAwaiter* self;
+            } async;
+            std::tuple<Cases...> cases;
+            Selection<sizeof...(Cases)> sel;
+            CspChan_Waiter waiter[sizeof...(Cases)];
+            std::coroutine_handle<> handle;
+            int result;
+        };
+
+        template<class Case>
+        class OpAwaiter : public SelectAwaiter<Case>
+        {
+        public:
+            explicit OpAwaiter(Case c):SelectAwaiter<Case>(std::move(c)) {}
+            bool await_resume() { return SelectAwaiter<Case>::await_resume() == 0; }
+        };
+    }
+
+    template<class Ch>
+    detail::OpAwaiter< RecvCase<Ch> > operator co_await(RecvCase<Ch>&& c)
+    {
+        return detail::OpAwaiter< RecvCase<Ch> >(std::move(c));
+    }
+
+    template<class Ch>
+    detail::OpAwaiter< SendCase<Ch> > operator co_await(SendCase<Ch>&& c)
+    {
+        return detail::OpAwaiter< SendCase<Ch> >(std::move(c));
+    }
+
+    /* co_await async_select(...) suspends until one of the cases is ready */
+    template<class... Cases>
+    detail::SelectAwaiter<typename std::decay<Cases>::type...> async_select(Cases&&... cases)
+    {
+        return detail::SelectAwaiter<typename std::decay<Cases>::type...>(std::forward<Cases>(cases)...);
+    }
+}
+#endif
+
+#endif /* CSP_CHANNEL_HPP */
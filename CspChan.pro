@@ -11,7 +11,10 @@ QMAKE_CFLAGS += -std=c89
 
 SOURCES += \
     CspChan.c \
+    CspPipe.c \
     test.c
 
 HEADERS += \
-    CspChan.h
+    CspChan.h \
+    CspChan.hpp \
+    CspPipe.h
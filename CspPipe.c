@@ -0,0 +1,713 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file may be used under the terms of the GNU Lesser
+* General Public License version 2.1 or version 3 as published by the Free
+* Software Foundation and appearing in the file LICENSE.LGPLv21 and
+* LICENSE.LGPLv3 included in the packaging of this file. Please review the
+* following information to ensure the GNU Lesser General Public License
+* requirements will be met: https://www.gnu.org/licenses/lgpl.html and
+* http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+*
+* Alternatively this file may be used under the terms of the Mozilla
+* Public License. If a copy of the MPL was not distributed with this
+* file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "CspPipe.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <memory.h>
+
+struct CspPipe_Stage
+{
+    CspChan_t* done; /* each agent of the stage sends one byte to it when it ends */
+    unsigned int agents;
+    void (*dispose)(CspPipe_Stage*);
+};
+
+static void init_stage(CspPipe_Stage* s, unsigned short maxAgents, void (*dispose)(CspPipe_Stage*))
+{
+    /* buffered, so the agents can end without waiting for CspPipe_join */
+    s->done = CspChan_create(maxAgents, 1);
+    s->agents = 0;
+    s->dispose = dispose;
+}
+
+static int start_agent(CspPipe_Stage* s, void* (*agent)(void*), void* arg)
+{
+    if( !CspChan_fork(agent, arg) )
+        return 0;
+    s->agents++;
+    return 1;
+}
+
+static unsigned int fnv1a(const void* key, unsigned int len)
+{
+    const unsigned char* k = (const unsigned char*)key;
+    unsigned int h = 2166136261u, i;
+    for( i = 0; i < len; i++ )
+    {
+        h ^= k[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static unsigned long long now_ms(void)
+{
+    /* simulated in CspChan_simulate mode */
+    return (unsigned long long)CspChan_now();
+}
+
+static void agent_done(CspPipe_Stage* s)
+{
+    unsigned char x = 1;
+    CspChan_send(s->done,&x);
+}
+
+void CspPipe_join(CspPipe_Stage* s)
+{
+    unsigned int i;
+    unsigned char x;
+    for( i = 0; i < s->agents; i++ )
+        CspChan_receive(s->done,&x);
+    CspChan_dispose(s->done);
+    s->dispose(s);
+}
+
+/* Ordered parallel map */
+
+enum { MapData, MapDropped, MapEnd, MapEmpty };
+
+/* prefix of the messages between the agents of a map stage; 8 bytes, so the payload stays aligned */
+typedef struct MapTag
+{
+    unsigned int seq;
+    unsigned int kind;
+} MapTag;
+
+typedef struct Map
+{
+    CspPipe_Stage stage;
+    CspChan_t* in;
+    CspChan_t* out;
+    CspChan_t* work; /* MapTag + input message, from the dispatcher to the workers */
+    CspChan_t* results; /* MapTag + output message, from the workers to the collector */
+    CspChan_t* credits; /* one token per message which may be in flight */
+    CspChan_Transform fn;
+    void* ctx;
+    unsigned int workers;
+    unsigned short maxInFlight, inLen, outLen;
+} Map;
+
+static void map_end(Map* m, unsigned int seq, int collector)
+{
+    MapTag* tag = (MapTag*)calloc(1, sizeof(MapTag) + (m->inLen > m->outLen ? m->inLen : m->outLen));
+    unsigned int i;
+    tag->kind = MapEnd;
+    for( i = 0; i < m->workers; i++ )
+        CspChan_send(m->work,tag);
+    if( collector )
+    {
+        /* tell the collector how many results to expect */
+        tag->seq = seq;
+        CspChan_send(m->results,tag);
+    }
+    free(tag);
+}
+
+static void* map_dispatch(void* arg)
+{
+    Map* m = (Map*)arg;
+    unsigned char* msg = (unsigned char*)malloc(sizeof(MapTag) + m->inLen);
+    MapTag* tag = (MapTag*)msg;
+    unsigned int seq = 0;
+    unsigned char credit;
+    while( CspChan_receive_n(m->in, msg + sizeof(MapTag), 1) )
+    {
+        /* blocks if the oldest message in flight is still being worked on */
+        CspChan_receive(m->credits,&credit);
+        tag->seq = seq++;
+        tag->kind = MapData;
+        CspChan_send(m->work,msg);
+    }
+    free(msg);
+    map_end(m, seq, 1);
+    agent_done(&m->stage);
+    return 0;
+}
+
+static void* map_work(void* arg)
+{
+    Map* m = (Map*)arg;
+    unsigned char* in = (unsigned char*)malloc(sizeof(MapTag) + m->inLen);
+    unsigned char* out = (unsigned char*)malloc(sizeof(MapTag) + m->outLen);
+    MapTag* inTag = (MapTag*)in;
+    MapTag* outTag = (MapTag*)out;
+    for(;;)
+    {
+        CspChan_receive(m->work,in);
+        if( inTag->kind == MapEnd )
+            break;
+        outTag->seq = inTag->seq;
+        outTag->kind = m->fn(m->ctx, in + sizeof(MapTag), out + sizeof(MapTag)) ? MapData : MapDropped;
+        CspChan_send(m->results,out);
+    }
+    free(in);
+    free(out);
+    agent_done(&m->stage);
+    return 0;
+}
+
+static void* map_collect(void* arg)
+{
+    Map* m = (Map*)arg;
+    const unsigned int slotLen = sizeof(MapTag) + m->outLen;
+    /* seq % maxInFlight never collides, since the credits limit the distance to the oldest message */
+    unsigned char* reorder = (unsigned char*)malloc(slotLen * m->maxInFlight);
+    unsigned char* msg = (unsigned char*)malloc(slotLen);
+    MapTag* tag = (MapTag*)msg;
+    unsigned int next = 0, end = 0, i;
+    int ended = 0;
+    const unsigned char credit = 1;
+    for( i = 0; i < m->maxInFlight; i++ )
+        ((MapTag*)(reorder + i * slotLen))->kind = MapEmpty;
+    while( !ended || next != end )
+    {
+        CspChan_receive(m->results,msg);
+        if( tag->kind == MapEnd )
+        {
+            ended = 1;
+            end = tag->seq;
+            continue;
+        }
+        memcpy(reorder + (tag->seq % m->maxInFlight) * slotLen, msg, slotLen);
+        for(;;)
+        {
+            unsigned char* slot = reorder + (next % m->maxInFlight) * slotLen;
+            MapTag* t = (MapTag*)slot;
+            if( t->kind == MapEmpty )
+                break;
+            if( t->kind == MapData )
+                CspChan_send(m->out, slot + sizeof(MapTag));
+            t->kind = MapEmpty;
+            next++;
+            CspChan_send(m->credits,(void*)&credit);
+        }
+    }
+    free(msg);
+    free(reorder);
+    agent_done(&m->stage);
+    return 0;
+}
+
+static void map_dispose(CspPipe_Stage* s)
+{
+    Map* m = (Map*)s;
+    CspChan_dispose(m->work);
+    CspChan_dispose(m->results);
+    CspChan_dispose(m->credits);
+    free(m);
+}
+
+CspPipe_Stage* CspPipe_map(CspChan_t* in, CspChan_t* out, unsigned int workers,
+                           unsigned short maxInFlight, CspChan_Transform fn, void* ctx)
+{
+    unsigned int i;
+    unsigned char credit = 1;
+    if( workers == 0 )
+        workers = 1;
+    if( workers > 0xfff0 )
+        workers = 0xfff0;
+    if( maxInFlight == 0 )
+        maxInFlight = 1;
+    if( maxInFlight == 0xffff )
+        maxInFlight--; /* the results channel needs one more slot for the end marker */
+    Map* m = (Map*)malloc(sizeof(Map));
+    init_stage(&m->stage, workers + 2, map_dispose);
+    m->in = in;
+    m->out = out;
+    m->fn = fn;
+    m->ctx = ctx;
+    m->maxInFlight = maxInFlight;
+    m->inLen = CspChan_msgLen(in);
+    m->outLen = CspChan_msgLen(out);
+    m->work = CspChan_create(maxInFlight, sizeof(MapTag) + m->inLen);
+    m->results = CspChan_create(maxInFlight + 1, sizeof(MapTag) + m->outLen);
+    m->credits = CspChan_create(maxInFlight, 1);
+    for( i = 0; i < maxInFlight; i++ )
+        CspChan_send(m->credits,&credit);
+    m->workers = 0;
+    for( i = 0; i < workers; i++ )
+    {
+        if( start_agent(&m->stage, map_work, m) )
+            m->workers++;
+    }
+    if( m->workers == 0 || !start_agent(&m->stage, map_collect, m) )
+    {
+        /* the workers are waiting for work; make them end */
+        map_end(m, 0, 0);
+        CspPipe_join(&m->stage);
+        return 0;
+    }
+    if( !start_agent(&m->stage, map_dispatch, m) )
+    {
+        map_end(m, 0, 1);
+        CspPipe_join(&m->stage);
+        return 0;
+    }
+    return &m->stage;
+}
+
+/* Batching */
+
+typedef struct Batch
+{
+    CspPipe_Stage stage;
+    CspChan_t* in;
+    CspChan_t* out;
+    unsigned int maxCount, maxDelayMs;
+    unsigned short inLen;
+} Batch;
+
+static void* batch_run(void* arg)
+{
+    Batch* b = (Batch*)arg;
+    /* calloc, so the unused tail of a batch is always zero */
+    unsigned char* batch = (unsigned char*)calloc(1, CspChan_msgLen(b->out));
+    unsigned int* count = (unsigned int*)batch;
+    unsigned long long deadline = 0;
+    int open = 1;
+    while( open )
+    {
+        void* slot = batch + CSPPIPE_BATCH_HEADER + *count * b->inLen;
+        if( *count == 0 )
+        {
+            open = CspChan_receive_n(b->in, slot, 1) != 0;
+            if( open )
+            {
+                deadline = now_ms() + b->maxDelayMs;
+                (*count)++;
+            }
+        }else
+        {
+            const unsigned long long now = now_ms();
+            if( now < deadline && CspChan_timed_select(&b->in, &slot, 1, 0, 0, 0, deadline - now) == 0 )
+                (*count)++;
+            else if( CspChan_closed(b->in) )
+                open = 0;
+            else
+                deadline = 0; /* timeout */
+        }
+        if( *count != 0 && (*count == b->maxCount || deadline == 0 || !open) )
+        {
+            CspChan_send(b->out, batch);
+            *count = 0;
+        }
+    }
+    free(batch);
+    agent_done(&b->stage);
+    return 0;
+}
+
+static void batch_dispose(CspPipe_Stage* s)
+{
+    free(s);
+}
+
+CspPipe_Stage* CspPipe_batch(CspChan_t* in, CspChan_t* out, unsigned int maxCount, unsigned int maxDelayMs)
+{
+    Batch* b = (Batch*)malloc(sizeof(Batch));
+    init_stage(&b->stage, 1, batch_dispose);
+    b->in = in;
+    b->out = out;
+    b->inLen = CspChan_msgLen(in);
+    b->maxDelayMs = maxDelayMs;
+    const unsigned int fits = CspChan_msgLen(out) < CSPPIPE_BATCH_HEADER ? 0 :
+                                (CspChan_msgLen(out) - CSPPIPE_BATCH_HEADER) / b->inLen;
+    b->maxCount = maxCount < fits ? maxCount : fits;
+    if( b->maxCount == 0 || !start_agent(&b->stage, batch_run, b) )
+    {
+        CspPipe_join(&b->stage);
+        return 0;
+    }
+    return &b->stage;
+}
+
+/* K-way merge */
+
+typedef struct MergeInput
+{
+    CspChan_t* in;
+    unsigned char* buf; /* batchLen messages received at once */
+    unsigned int pos, len;
+} MergeInput;
+
+typedef struct Merge
+{
+    CspPipe_Stage stage;
+    CspChan_t* out;
+    CspPipe_Compare cmp;
+    void* ctx;
+    unsigned int count;
+    unsigned short batchLen, msgLen;
+    unsigned int* heap; /* indices of the open inputs, ordered by their head message */
+    MergeInput input[1]; /* count entries */
+} Merge;
+
+static const void* merge_head(Merge* m, unsigned int i)
+{
+    return m->input[i].buf + m->input[i].pos * m->msgLen;
+}
+
+static int merge_before(Merge* m, unsigned int a, unsigned int b)
+{
+    /* equal heads are taken in the order of the inputs, so the merge is stable */
+    const int res = m->cmp(m->ctx, merge_head(m, a), merge_head(m, b));
+    return res < 0 || (res == 0 && a < b);
+}
+
+static void merge_down(Merge* m, unsigned int n, unsigned int i)
+{
+    const unsigned int x = m->heap[i];
+    for(;;)
+    {
+        unsigned int child = 2 * i + 1;
+        if( child >= n )
+            break;
+        if( child + 1 < n && merge_before(m, m->heap[child + 1], m->heap[child]) )
+            child++;
+        if( !merge_before(m, m->heap[child], x) )
+            break;
+        m->heap[i] = m->heap[child];
+        i = child;
+    }
+    m->heap[i] = x;
+}
+
+static int merge_fill(Merge* m, unsigned int i)
+{
+    /* blocks until the input has a message, since it could be the smallest of all; returns 0 at its end */
+    MergeInput* in = &m->input[i];
+    in->pos = 0;
+    in->len = CspChan_receive_n(in->in, in->buf, m->batchLen);
+    return in->len != 0;
+}
+
+static void* merge_run(void* arg)
+{
+    Merge* m = (Merge*)arg;
+    unsigned int n = 0, i;
+    for( i = 0; i < m->count; i++ )
+    {
+        if( merge_fill(m, i) )
+            m->heap[n++] = i;
+    }
+    for( i = n / 2; i-- > 0; )
+        merge_down(m, n, i);
+    while( n != 0 )
+    {
+        MergeInput* in = &m->input[m->heap[0]];
+        CspChan_send(m->out, (void*)merge_head(m, m->heap[0]));
+        in->pos++;
+        if( in->pos == in->len && !merge_fill(m, m->heap[0]) )
+            m->heap[0] = m->heap[--n];
+        if( n != 0 )
+            merge_down(m, n, 0);
+    }
+    agent_done(&m->stage);
+    return 0;
+}
+
+static void merge_dispose(CspPipe_Stage* s)
+{
+    Merge* m = (Merge*)s;
+    unsigned int i;
+    for( i = 0; i < m->count; i++ )
+        free(m->input[i].buf);
+    free(m->heap);
+    free(m);
+}
+
+CspPipe_Stage* CspPipe_merge(CspChan_t** in, unsigned int count, CspChan_t* out, unsigned short batchLen,
+                             CspPipe_Compare cmp, void* ctx)
+{
+    unsigned int i;
+    if( count == 0 )
+        return 0;
+    for( i = 0; i < count; i++ )
+    {
+        if( CspChan_msgLen(in[i]) != CspChan_msgLen(out) )
+            return 0;
+    }
+    if( batchLen == 0 )
+        batchLen = 1;
+    Merge* m = (Merge*)malloc(sizeof(Merge) + (count - 1) * sizeof(MergeInput));
+    init_stage(&m->stage, 1, merge_dispose);
+    m->out = out;
+    m->cmp = cmp;
+    m->ctx = ctx;
+    m->count = count;
+    m->batchLen = batchLen;
+    m->msgLen = CspChan_msgLen(out);
+    m->heap = (unsigned int*)malloc(count * sizeof(unsigned int));
+    for( i = 0; i < count; i++ )
+    {
+        m->input[i].in = in[i];
+        m->input[i].buf = (unsigned char*)malloc(batchLen * m->msgLen);
+        m->input[i].pos = m->input[i].len = 0;
+    }
+    if( !start_agent(&m->stage, merge_run, m) )
+    {
+        CspPipe_join(&m->stage);
+        return 0;
+    }
+    return &m->stage;
+}
+
+/* Windowed join */
+
+typedef struct WindowEntry
+{
+    unsigned long long time; /* when the record was received */
+    int older, newer; /* the age list, or the unused list in newer */
+    int chain; /* the next entry of the hash bucket in age order, or -1 */
+    int side; /* 0 for left, 1 for right */
+} WindowEntry;
+
+typedef struct Window
+{
+    CspPipe_Stage stage;
+    CspChan_t* in[2]; /* left, right */
+    CspChan_t* out;
+    CspPipe_WindowStats st;
+    CspPipe_WindowStats* stats;
+    unsigned int windowMs, maxBuffered, buckets, count;
+    unsigned short len[2], keyOffset, keyLen, stride;
+    WindowEntry* entry; /* maxBuffered entries */
+    unsigned char* msgs; /* the message of each entry, stride bytes apart */
+    int* bucket; /* the first entry of each bucket, or -1 */
+    int oldest, newest, unused;
+} Window;
+
+static unsigned int window_bucket(Window* w, const unsigned char* msg)
+{
+    return fnv1a(msg + w->keyOffset, w->keyLen) & (w->buckets - 1);
+}
+
+static void window_remove(Window* w, int e)
+{
+    WindowEntry* x = &w->entry[e];
+    int* link = &w->bucket[window_bucket(w, w->msgs + e * w->stride)];
+    while( *link != e )
+        link = &w->entry[*link].chain;
+    *link = x->chain;
+    if( x->older >= 0 )
+        w->entry[x->older].newer = x->newer;
+    else
+        w->oldest = x->newer;
+    if( x->newer >= 0 )
+        w->entry[x->newer].older = x->older;
+    else
+        w->newest = x->older;
+    x->newer = w->unused;
+    w->unused = e;
+    w->count--;
+}
+
+static void window_expire(Window* w, unsigned long long now)
+{
+    while( w->oldest >= 0 && w->entry[w->oldest].time + w->windowMs < now )
+    {
+        window_remove(w, w->oldest);
+        w->st.expired++;
+    }
+}
+
+static void window_arrive(Window* w, int side, const unsigned char* msg, unsigned char* pair)
+{
+    /* msg is in pair already, at the position of its side */
+    const unsigned int b = window_bucket(w, msg);
+    int e, *link;
+    for( e = w->bucket[b]; e >= 0; e = w->entry[e].chain )
+    {
+        /* the oldest record of the other side with the same key */
+        if( w->entry[e].side != side &&
+                memcmp(w->msgs + e * w->stride + w->keyOffset, msg + w->keyOffset, w->keyLen) == 0 )
+            break;
+    }
+    if( e >= 0 )
+    {
+        memcpy(side == 0 ? pair + w->len[0] : pair, w->msgs + e * w->stride, w->len[!side]);
+        window_remove(w, e);
+        w->st.joined++;
+        CspChan_send(w->out, pair);
+        return;
+    }
+    if( w->count == w->maxBuffered )
+    {
+        window_remove(w, w->oldest);
+        w->st.overflowed++;
+    }
+    e = w->unused;
+    w->unused = w->entry[e].newer;
+    w->count++;
+    memcpy(w->msgs + e * w->stride, msg, w->len[side]);
+    w->entry[e].time = now_ms();
+    w->entry[e].side = side;
+    w->entry[e].chain = -1;
+    link = &w->bucket[b];
+    while( *link >= 0 )
+        link = &w->entry[*link].chain;
+    *link = e;
+    w->entry[e].older = w->newest;
+    w->entry[e].newer = -1;
+    if( w->newest >= 0 )
+        w->entry[w->newest].newer = e;
+    else
+        w->oldest = e;
+    w->newest = e;
+}
+
+static void* window_run(void* arg)
+{
+    Window* w = (Window*)arg;
+    /* calloc, so the unused tail of a pair is always zero */
+    unsigned char* pair = (unsigned char*)calloc(1, CspChan_msgLen(w->out));
+    void* data[2];
+    data[0] = pair;
+    data[1] = pair + w->len[0];
+    for(;;)
+    {
+        const unsigned long long now = now_ms();
+        int i;
+        window_expire(w, now);
+        if( w->oldest < 0 )
+            i = CspChan_select(w->in, data, 2, 0, 0, 0);
+        else
+        {
+            /* wake up in time to evict the oldest record */
+            const unsigned long long due = w->entry[w->oldest].time + w->windowMs + 1;
+            i = CspChan_timed_select(w->in, data, 2, 0, 0, 0, (unsigned int)(due - now));
+        }
+        if( i >= 0 )
+            window_arrive(w, i, (unsigned char*)data[i], pair);
+        else if( CspChan_closed(w->in[0]) && CspChan_closed(w->in[1]) )
+            break;
+    }
+    w->st.unmatched += w->count;
+    if( w->stats )
+        *w->stats = w->st;
+    free(pair);
+    agent_done(&w->stage);
+    return 0;
+}
+
+static void window_dispose(CspPipe_Stage* s)
+{
+    Window* w = (Window*)s;
+    free(w->entry);
+    free(w->msgs);
+    free(w->bucket);
+    free(w);
+}
+
+CspPipe_Stage* CspPipe_window_join(CspChan_t* left, CspChan_t* right, CspChan_t* out, unsigned short keyOffset,
+                                   unsigned short keyLen, unsigned int windowMs, unsigned int maxBuffered,
+                                   CspPipe_WindowStats* stats)
+{
+    const unsigned short leftLen = CspChan_msgLen(left), rightLen = CspChan_msgLen(right);
+    unsigned int i;
+    if( keyLen == 0 || keyOffset + keyLen > leftLen || keyOffset + keyLen > rightLen ||
+            CspChan_msgLen(out) < CSPPIPE_JOIN_LEN(leftLen, rightLen) || maxBuffered == 0 || maxBuffered > 0x1000000 )
+        return 0;
+    Window* w = (Window*)malloc(sizeof(Window));
+    init_stage(&w->stage, 1, window_dispose);
+    w->in[0] = left;
+    w->in[1] = right;
+    w->out = out;
+    memset(&w->st, 0, sizeof(CspPipe_WindowStats));
+    w->stats = stats;
+    w->windowMs = windowMs;
+    w->maxBuffered = maxBuffered;
+    w->count = 0;
+    w->len[0] = leftLen;
+    w->len[1] = rightLen;
+    w->keyOffset = keyOffset;
+    w->keyLen = keyLen;
+    w->stride = leftLen > rightLen ? leftLen : rightLen;
+    w->buckets = 1;
+    while( w->buckets < maxBuffered )
+        w->buckets *= 2;
+    w->entry = (WindowEntry*)malloc(maxBuffered * sizeof(WindowEntry));
+    w->msgs = (unsigned char*)malloc(maxBuffered * w->stride);
+    w->bucket = (int*)malloc(w->buckets * sizeof(int));
+    for( i = 0; i < w->buckets; i++ )
+        w->bucket[i] = -1;
+    for( i = 0; i < maxBuffered; i++ )
+        w->entry[i].newer = i + 1 < maxBuffered ? (int)i + 1 : -1;
+    w->unused = 0;
+    w->oldest = w->newest = -1;
+    if( !start_agent(&w->stage, window_run, w) )
+    {
+        CspPipe_join(&w->stage);
+        return 0;
+    }
+    return &w->stage;
+}
+
+/* Key partitioned channel group */
+
+struct CspPipe_Partitions
+{
+    unsigned int count;
+    CspChan_t* part[1]; /* count entries */
+};
+
+CspPipe_Partitions* CspPipe_partitions_create(unsigned int count, unsigned short queueLen, unsigned short msgLen)
+{
+    unsigned int i;
+    if( count == 0 )
+        count = 1;
+    CspPipe_Partitions* p = (CspPipe_Partitions*)malloc(sizeof(CspPipe_Partitions) + (count - 1) * sizeof(CspChan_t*));
+    p->count = count;
+    for( i = 0; i < count; i++ )
+        p->part[i] = CspChan_create(queueLen, msgLen);
+    return p;
+}
+
+unsigned int CspPipe_partitions_of(CspPipe_Partitions* p, const void* key, unsigned int keyLen)
+{
+    return fnv1a(key, keyLen) % p->count;
+}
+
+void CspPipe_partitions_send(CspPipe_Partitions* p, const void* key, unsigned int keyLen, void* dataPtr)
+{
+    CspChan_send(p->part[CspPipe_partitions_of(p, key, keyLen)], dataPtr);
+}
+
+CspChan_t* CspPipe_partitions_channel(CspPipe_Partitions* p, unsigned int i)
+{
+    return i < p->count ? p->part[i] : 0;
+}
+
+unsigned int CspPipe_partitions_count(CspPipe_Partitions* p)
+{
+    return p->count;
+}
+
+void CspPipe_partitions_close(CspPipe_Partitions* p)
+{
+    unsigned int i;
+    for( i = 0; i < p->count; i++ )
+        CspChan_close(p->part[i]);
+}
+
+void CspPipe_partitions_dispose(CspPipe_Partitions* p)
+{
+    unsigned int i;
+    for( i = 0; i < p->count; i++ )
+        CspChan_dispose(p->part[i]);
+    free(p);
+}
@@ -0,0 +1,141 @@
+#ifndef CSP_PIPE_H
+#define CSP_PIPE_H
+
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file may be used under the terms of the GNU Lesser
+* General Public License version 2.1 or version 3 as published by the Free
+* Software Foundation and appearing in the file LICENSE.LGPLv21 and
+* LICENSE.LGPLv3 included in the packaging of this file. Please review the
+* following information to ensure the GNU Lesser General Public License
+* requirements will be met: https://www.gnu.org/licenses/lgpl.html and
+* http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+*
+* Alternatively this file may be used under the terms of the Mozilla
+* Public License. If a copy of the MPL was not distributed with this
+* file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+/* CspPipe:
+ * Reusable pipeline stages built on CspChan. A stage reads from one or more input channels and writes
+ * to an output channel, using agents started by CspChan_fork. A stage ends when its input is closed;
+ * since closing a channel discards the messages still buffered in it, inputs should be unbuffered or be
+ * closed only when the stage has caught up. The output channel is not closed by the stage. */
+
+#include "CspChan.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct CspPipe_Stage CspPipe_Stage;
+
+/* CspPipe_join:
+ * Waits until the stage has ended, i.e. its input was closed and everything received before was written
+ * to the output channel, and then releases the stage. */
+CSPCHANEXP void CspPipe_join(CspPipe_Stage*);
+
+/* CspPipe_map:
+ * Starts an ordered parallel map stage; workers agents call fn (see CspChan_Transform) for the messages
+ * received from in, and the results are written to out in the order of the input, omitting those fn
+ * dropped. Each message is tagged with a sequence number, and the results are reassembled in a reorder
+ * buffer. At most maxInFlight messages are between in and out at any time, which bounds the reorder
+ * buffer; if the oldest message is slow, the stage stops receiving until it is done. fn must be
+ * thread-safe if workers > 1. Returns NULL if the agents could not be started. */
+CSPCHANEXP CspPipe_Stage* CspPipe_map(CspChan_t* in, CspChan_t* out, unsigned int workers,
+                                      unsigned short maxInFlight, CspChan_Transform fn, void* ctx);
+
+/* CspPipe_batch:
+ * Starts a batching stage; it collects the messages received from in and sends them to out as one batch
+ * message as soon as maxCount messages are collected, or maxDelayMs milliseconds have passed since the
+ * first message of the batch was received, or in was closed. A batch message starts with the number of
+ * messages as an unsigned int, followed by the messages from offset CSPPIPE_BATCH_HEADER on; out must be
+ * created with a msgLen of at least CSPPIPE_BATCH_LEN(maxCount, msgLen of in), otherwise maxCount is
+ * reduced to what fits. The stage holds at most one batch, so its memory is bounded. Returns NULL if the
+ * agent could not be started. */
+CSPCHANEXP CspPipe_Stage* CspPipe_batch(CspChan_t* in, CspChan_t* out, unsigned int maxCount, unsigned int maxDelayMs);
+#define CSPPIPE_BATCH_HEADER 8
+#define CSPPIPE_BATCH_LEN(maxCount, msgLen) (CSPPIPE_BATCH_HEADER + (maxCount) * (msgLen))
+
+/* CspPipe_Compare:
+ * Compares two messages like the function passed to qsort; returns a negative number if a sorts before b,
+ * a positive one if a sorts after b, and 0 if they are equal. ctx is the value passed to the stage. */
+typedef int (*CspPipe_Compare)(void* ctx, const void* a, const void* b);
+
+/* CspPipe_merge:
+ * Starts a k-way merge stage; it receives from the count input channels, each of which delivers its
+ * messages sorted by cmp, and writes all of them to out in the globally sorted order. The stage keeps the
+ * head messages of the inputs in a heap, so each message costs O(log count) comparisons, and receives up to
+ * batchLen messages from an input at once (see CspChan_receive_n). Equal messages are written in the order
+ * of the inputs. To know the smallest message, the stage has to wait until every input which is not closed
+ * has a message; a closed input is considered ended and leaves the merge. All inputs must have the msgLen
+ * of out. Returns NULL if count is 0, the msgLen differ, or the agent could not be started. */
+CSPCHANEXP CspPipe_Stage* CspPipe_merge(CspChan_t** in, unsigned int count, CspChan_t* out, unsigned short batchLen,
+                                        CspPipe_Compare cmp, void* ctx);
+
+typedef struct CspPipe_WindowStats
+{
+    unsigned long joined; /* pairs written to out */
+    unsigned long expired; /* records evicted unmatched because they were older than windowMs */
+    unsigned long overflowed; /* records evicted unmatched because maxBuffered records were buffered */
+    unsigned long unmatched; /* records still buffered when both inputs were closed */
+} CspPipe_WindowStats;
+
+/* CspPipe_window_join:
+ * Starts a windowed join stage; it receives records from left and right and pairs each with the oldest
+ * record of the other input which has the same key (keyLen bytes at keyOffset in the messages of both
+ * inputs) and was received at most windowMs milliseconds before. A pair is written to out as the left
+ * message immediately followed by the right one; out must be created with a msgLen of at least
+ * CSPPIPE_JOIN_LEN(msgLen of left, msgLen of right). Each record is joined at most once; a record without
+ * a partner is buffered in a hash table until its partner arrives, or it is evicted when it is older than
+ * windowMs, or when maxBuffered records are buffered and another one arrives, in which case the oldest
+ * is evicted. Thus the memory of the stage is bounded by maxBuffered records. The stage ends when both
+ * inputs are closed; if stats is not NULL, the counters are copied to it then, i.e. they are valid after
+ * CspPipe_join. The time is that of CspChan_now. Returns NULL if the key doesn't fit the messages, out is
+ * too small, maxBuffered is 0 or above 16M, or the agent could not be started. */
+CSPCHANEXP CspPipe_Stage* CspPipe_window_join(CspChan_t* left, CspChan_t* right, CspChan_t* out,
+                                              unsigned short keyOffset, unsigned short keyLen, unsigned int windowMs,
+                                              unsigned int maxBuffered, CspPipe_WindowStats* stats);
+#define CSPPIPE_JOIN_LEN(leftLen, rightLen) ((leftLen) + (rightLen))
+
+typedef struct CspPipe_Partitions CspPipe_Partitions;
+
+/* CspPipe_partitions_create:
+ * Creates a group of count buffered channels (see CspChan_create) which behaves like one channel
+ * partitioned by a key: all messages sent with the same key go to the same channel and thus arrive in
+ * the order sent, whereas messages with different keys can be processed in parallel by one receiver per
+ * partition. Backpressure applies per partition, i.e. a sender only blocks if the partition of its key is
+ * full. */
+CSPCHANEXP CspPipe_Partitions* CspPipe_partitions_create(unsigned int count, unsigned short queueLen,
+                                                         unsigned short msgLen);
+
+/* CspPipe_partitions_of:
+ * Returns the index of the partition the key of keyLen bytes is hashed to. */
+CSPCHANEXP unsigned int CspPipe_partitions_of(CspPipe_Partitions*, const void* key, unsigned int keyLen);
+
+/* CspPipe_partitions_send:
+ * Sends the message to the partition of the key, blocking as long as this partition is full. */
+CSPCHANEXP void CspPipe_partitions_send(CspPipe_Partitions*, const void* key, unsigned int keyLen, void* dataPtr);
+
+/* CspPipe_partitions_channel:
+ * Returns the channel of partition i, e.g. for the receiver of this partition to receive or select on. */
+CSPCHANEXP CspChan_t* CspPipe_partitions_channel(CspPipe_Partitions*, unsigned int i);
+
+/* CspPipe_partitions_count:
+ * Returns the number of partitions. */
+CSPCHANEXP unsigned int CspPipe_partitions_count(CspPipe_Partitions*);
+
+/* CspPipe_partitions_close:
+ * Closes all partitions (see CspChan_close). */
+CSPCHANEXP void CspPipe_partitions_close(CspPipe_Partitions*);
+
+/* CspPipe_partitions_dispose:
+ * Disposes all partitions and the group. */
+CSPCHANEXP void CspPipe_partitions_dispose(CspPipe_Partitions*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CSP_PIPE_H */
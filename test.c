@@ -15,10 +15,13 @@
 */
 
 #include "CspChan.h"
+#include "CspPipe.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
 
 static int threadcount = 0;
 static pthread_mutex_t mtx;
@@ -37,6 +40,13 @@ static void dec()
 
 static const char* err = "";
 
+/* storage for a channel with one int, e.g. on the stack */
+typedef union int_chan_storage {
+    unsigned char mem[CSPCHAN_SIZEOF_MAX(1,sizeof(int))];
+    long double align;
+    void* alignPtr;
+} int_chan_storage;
+
 typedef struct fibonacci_arg {
     CspChan_t* f;
     int x;
@@ -52,7 +62,9 @@ static void* fibonacci(void* arg)
         CspChan_send(fa->f, &fa->x);
     else
     {
-        CspChan_t* g = CspChan_create(1,sizeof(int));
+        /* the channels live on the stack of this agent, so there is no heap traffic for them */
+        int_chan_storage gMem, hMem;
+        CspChan_t* g = CspChan_init(gMem.mem,1,sizeof(int));
         fibonacci_arg* arg1 = (fibonacci_arg*)malloc(sizeof(fibonacci_arg));
         arg1->f = g;
         arg1->x = fa->x - 1;
@@ -70,7 +82,7 @@ static void* fibonacci(void* arg)
             return 0;
         }
 
-        CspChan_t* h = CspChan_create(1,sizeof(int));
+        CspChan_t* h = CspChan_init(hMem.mem,1,sizeof(int));
         fibonacci_arg* arg2 = (fibonacci_arg*)malloc(sizeof(fibonacci_arg));
         arg2->f = h;
         arg2->x = fa->x - 2;
@@ -442,8 +454,8 @@ static void testSieve2()
     CspChan_fork(print2,pa);
 
     int eof;
-    CspChan_receive(pa->outEof,&eof);
-    CspChan_receive(pa->outEof,&eof);
+    CspChan_receive(end,&eof);
+    CspChan_receive(end,&eof);
 
     CspChan_dispose(a);
     CspChan_dispose(b);
@@ -544,6 +556,1252 @@ static void* rx(void* arg)
     return 0;
 }
 
+typedef struct stream_arg {
+    CspChan_t* out;
+    int n;
+} stream_arg;
+
+static void* streamer(void* arg)
+{
+    stream_arg sa = *(stream_arg*)arg; /* the receiver's stack is gone after the last message */
+    int msg[16] = { 0 };
+    int i;
+    for( i = 1; i <= sa.n; i++ )
+    {
+        msg[0] = i;
+        CspChan_send(sa.out,msg);
+    }
+    return 0;
+}
+
+static void testHugePages()
+{
+    /* 60000 * 64 bytes spans more than one 2MB huge page */
+    CspChan_t* c = CspChan_create_ex(60000,64,CspChan_HugePages | CspChan_Prefault);
+    stream_arg sa;
+    sa.out = c;
+    sa.n = 200000;
+    CspChan_fork(streamer,&sa);
+    long long sum = 0;
+    int i;
+    for( i = 0; i < sa.n; i++ )
+    {
+        int msg[16];
+        CspChan_receive(c,msg);
+        sum += msg[0];
+    }
+    CspChan_dispose(c);
+    printf("huge pages: sum %lld %s\n", sum, sum == (long long)sa.n*(sa.n+1)/2 ? "ok" : "error");
+}
+
+typedef struct batch_arg {
+    CspChan_t* out;
+    int n;
+} batch_arg;
+
+static void* batchSender(void* arg)
+{
+    batch_arg ba = *(batch_arg*)arg;
+    int buf[7*3];
+    int i = 0;
+    while( i < ba.n )
+    {
+        int j;
+        for( j = 0; j < 7; j++ )
+        {
+            buf[j*3] = i + j;
+            buf[j*3+1] = -(i + j);
+            buf[j*3+2] = 0;
+        }
+        i += CspChan_send_n(ba.out,buf,7);
+    }
+    return 0;
+}
+
+static void testBatch()
+{
+    /* 12 byte messages, so the mirrored ring has to be rounded up to whole pages */
+    CspChan_t* c = CspChan_create_ex(100,12,CspChan_Mirrored);
+    batch_arg ba;
+    ba.out = c;
+    ba.n = 7 * 10000;
+    CspChan_fork(batchSender,&ba);
+    int expected = 0;
+    const char* res = "ok";
+    while( expected < ba.n )
+    {
+        int buf[10*3];
+        const int n = CspChan_receive_n(c,buf,10);
+        int j;
+        for( j = 0; j < n; j++, expected++ )
+            if( buf[j*3] != expected || buf[j*3+1] != -expected )
+                res = "error";
+    }
+    CspChan_dispose(c);
+    printf("batch: %d messages %s\n", expected, res);
+}
+
+typedef struct compact_arg {
+    CspChan_t* a;
+    CspChan_t* b;
+    int n;
+} compact_arg;
+
+static void* compactSender(void* arg)
+{
+    compact_arg ca = *(compact_arg*)arg;
+    int i;
+    for( i = 0; i < ca.n; i++ )
+        CspChan_send(i % 2 ? ca.b : ca.a,&i);
+    return 0;
+}
+
+static void testCompact()
+{
+    enum { count = 100000 };
+    CspChan_t** all = (CspChan_t**)malloc(count*sizeof(CspChan_t*));
+    int i, sum = 0;
+    for( i = 0; i < count; i++ )
+        all[i] = CspChan_create_ex(1,sizeof(int),CspChan_Compact);
+    for( i = 0; i < count; i += 100 )
+        CspChan_send(all[i],&i); /* only a few of them ever get a ring buffer */
+    for( i = 0; i < count; i += 100 )
+    {
+        int x;
+        CspChan_receive(all[i],&x);
+        sum += x == i;
+    }
+    for( i = 0; i < count; i++ )
+        CspChan_dispose(all[i]);
+    free(all);
+
+    /* an unbuffered and a buffered compact channel, received by select */
+    compact_arg ca;
+    ca.a = CspChan_create_ex(0,sizeof(int),CspChan_Compact);
+    ca.b = CspChan_create_ex(2,sizeof(int),CspChan_Compact);
+    ca.n = 10000;
+    CspChan_fork(compactSender,&ca);
+    for( i = 0; i < ca.n; i++ )
+    {
+        int a, b;
+        CspChan_t* receivers[2] = { ca.a, ca.b };
+        void* rData[2] = { &a, &b };
+        switch( CspChan_select(receivers,rData,2, 0, 0, 0) )
+        {
+        case 0:
+            sum += a % 2 == 0;
+            break;
+        case 1:
+            sum += b % 2 == 1;
+            break;
+        }
+    }
+    CspChan_dispose(ca.a);
+    CspChan_dispose(ca.b);
+    printf("compact: %s\n", sum == count / 100 + ca.n ? "ok" : "error");
+}
+
+static void testLazy()
+{
+    CspChan_t* c = CspChan_create_ex(10000,sizeof(int),CspChan_Lazy);
+    int i, j, ok = 1;
+    for( j = 1; j <= 3; j++ )
+    {
+        /* fill up to a different level each time, so the ring has to grow and shrink repeatedly */
+        const int n = j * 3000;
+        for( i = 0; i < n; i++ )
+            CspChan_send(c,&i);
+        for( i = 0; i < n; i++ )
+        {
+            int x;
+            CspChan_receive(c,&x);
+            ok = ok && x == i;
+            if( i % 7 == 0 )
+                CspChan_send(c,&i); /* interleave, so the content wraps around */
+        }
+        for( i = 0; i < n; i += 7 )
+        {
+            int x;
+            CspChan_receive(c,&x);
+            ok = ok && x == i;
+        }
+    }
+    CspChan_dispose(c);
+    printf("lazy: %s\n", ok ? "ok" : "error");
+}
+
+static void testLargeMessages()
+{
+    enum { len = 20000 }; /* neither a multiple of 16 nor of 64 */
+    CspChan_t* c = CspChan_create_ex(4,len,CspChan_NonTemporal);
+    unsigned char* in = (unsigned char*)malloc(len);
+    unsigned char* out = (unsigned char*)malloc(len);
+    int i, j, ok = 1;
+    for( i = 0; i < 10; i++ )
+    {
+        for( j = 0; j < len; j++ )
+            in[j] = (unsigned char)(i + j);
+        CspChan_send(c,in);
+        CspChan_receive(c,out);
+        ok = ok && memcmp(in,out,len) == 0;
+    }
+    free(in);
+    free(out);
+    /* batches take the same path, also across the wrap point of the ring */
+    in = (unsigned char*)malloc(3 * len);
+    out = (unsigned char*)malloc(3 * len);
+    for( i = 0; i < 5 && ok; i++ )
+    {
+        for( j = 0; j < 3 * len; j++ )
+            in[j] = (unsigned char)(i * 3 + j);
+        ok = CspChan_send_n(c,in,3) == 3 && CspChan_receive_n(c,out,3) == 3 && memcmp(in,out,3 * len) == 0;
+    }
+    free(in);
+    free(out);
+    CspChan_dispose(c);
+    printf("large messages: %s\n", ok ? "ok" : "error");
+}
+
+typedef struct AsyncReceiver
+{
+    CspChan_Async op;
+    CspChan_t* from[2];
+    void* data[2];
+    CspChan_Waiter waiter[2];
+    int x, sum, ends;
+    CspChan_t* finished;
+} AsyncReceiver;
+
+static void asyncReceived(CspChan_Async* op, int n);
+
+static int asyncHandle(AsyncReceiver* r, int n)
+{
+    /* returns 1 when both senders are done */
+    if( n >= 0 && r->x >= 0 )
+    {
+        r->sum += r->x;
+        return 0;
+    }
+    if( n >= 0 && ++r->ends < 2 )
+        return 0;
+    CspChan_send(r->finished,&r->sum);
+    return 1;
+}
+
+static void asyncReceive(AsyncReceiver* r)
+{
+    /* continue synchronously as long as messages are available, then leave it to the worker pool */
+    int n;
+    while( (n = CspChan_async_select(&r->op)) != CspChan_Pending )
+    {
+        if( asyncHandle(r,n) )
+            return;
+    }
+}
+
+static void asyncReceived(CspChan_Async* op, int n)
+{
+    AsyncReceiver* r = (AsyncReceiver*)op;
+    if( !asyncHandle(r,n) )
+        asyncReceive(r);
+}
+
+static void* asyncSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 1; i <= 1000; i++ )
+    {
+        CspChan_send(c,&i);
+        if( i % 100 == 0 )
+            CspChan_sleep(1); /* let the receiver run out of messages now and then */
+    }
+    i = -1;
+    CspChan_send(c,&i);
+    return 0;
+}
+
+static void testAsync()
+{
+    AsyncReceiver r;
+    memset(&r,0,sizeof(r));
+    r.from[0] = CspChan_create(4,sizeof(int));
+    r.from[1] = CspChan_create(4,sizeof(int));
+    r.data[0] = r.data[1] = &r.x;
+    r.finished = CspChan_create(0,sizeof(int));
+    r.op.receiver = r.from;
+    r.op.rData = r.data;
+    r.op.rCount = 2;
+    r.op.waiter = r.waiter;
+    r.op.done = asyncReceived;
+    CspChan_fork(asyncSender,r.from[0]);
+    CspChan_fork(asyncSender,r.from[1]);
+    asyncReceive(&r);
+    int sum;
+    CspChan_receive(r.finished,&sum);
+    CspChan_dispose(r.from[0]);
+    CspChan_dispose(r.from[1]);
+    CspChan_dispose(r.finished);
+    printf("async: %s\n", sum == 2 * 500500 ? "ok" : "error");
+}
+
+static int notMultiple(void* ctx, const void* in, void* out)
+{
+    const int x = *(const int*)in;
+    *(int*)out = x;
+    return x == 0 || x % *(int*)ctx != 0; /* 0 is the end marker */
+}
+
+static int square(void* ctx, const void* in, void* out)
+{
+    const int x = *(const int*)in;
+    *(int*)out = x * x;
+    return 1;
+}
+
+static int widen(void* ctx, const void* in, void* out)
+{
+    *(long long*)out = *(const int*)in;
+    return 1;
+}
+
+static void* fusedSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 1; i <= 1000; i++ )
+        CspChan_send(c,&i);
+    i = 0;
+    CspChan_send(c,&i);
+    return 0;
+}
+
+static void testFusion()
+{
+    /* filter and map stages without threads of their own, as the y % x != 0 stages of sieve2 */
+    int three = 3;
+    CspChan_t* out = CspChan_create(16,sizeof(int));
+    CspChan_t* squares = CspChan_fuse(out,sizeof(int),square,0);
+    CspChan_t* in = CspChan_fuse(squares,sizeof(int),notMultiple,&three);
+    CspChan_t* wide = CspChan_fuse_receive(out,sizeof(long long),widen,0);
+    CspChan_fork(fusedSender,in);
+    long long x, sum = 0, expected = 0;
+    int i;
+    for( i = 1; i <= 1000; i++ )
+    {
+        if( i % 3 != 0 )
+            expected += i * i;
+    }
+    do
+    {
+        CspChan_receive(wide,&x);
+        sum += x;
+    }while( x != 0 );
+    CspChan_dispose(wide);
+    CspChan_dispose(in);
+    CspChan_dispose(squares);
+    CspChan_dispose(out);
+    printf("fusion: %s\n", sum == expected ? "ok" : "error");
+}
+
+static int slowSquare(void* ctx, const void* in, void* out)
+{
+    const int x = *(const int*)in;
+    if( x % 3 == 0 )
+        CspChan_sleep(1); /* so the results arrive out of order */
+    *(int*)out = x * x;
+    return x % 5 != 0;
+}
+
+static void* mapSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 1; i <= 300; i++ )
+        CspChan_send(c,&i);
+    /* c is unbuffered, so nothing is lost by closing it */
+    CspChan_close(c);
+    return 0;
+}
+
+static void testParallelMap()
+{
+    CspChan_t* in = CspChan_create(0,sizeof(int));
+    CspChan_t* out = CspChan_create(8,sizeof(int));
+    CspPipe_Stage* s = CspPipe_map(in,out,4,16,slowSquare,0);
+    CspChan_fork(mapSender,in);
+    int i, x, ok = s != 0;
+    for( i = 1; i <= 300 && ok; i++ )
+    {
+        if( i % 5 == 0 )
+            continue;
+        CspChan_receive(out,&x);
+        ok = x == i * i;
+    }
+    CspPipe_join(s);
+    CspChan_dispose(in);
+    CspChan_dispose(out);
+    printf("parallel map: %s\n", ok ? "ok" : "error");
+}
+
+typedef struct keyed_msg {
+    int key, seq;
+} keyed_msg;
+
+typedef struct partition_arg {
+    CspPipe_Partitions* p;
+    unsigned int index;
+    CspChan_t* result;
+} partition_arg;
+
+static void* partitionReceiver(void* arg)
+{
+    partition_arg pa = *(partition_arg*)arg;
+    CspChan_t* c = CspPipe_partitions_channel(pa.p,pa.index);
+    int last[16];
+    int i, count = 0, ok = 1;
+    for( i = 0; i < 16; i++ )
+        last[i] = -1;
+    for(;;)
+    {
+        keyed_msg m;
+        CspChan_receive(c,&m);
+        if( m.key < 0 )
+            break;
+        /* the same key always arrives at the same receiver, in the order sent */
+        ok = ok && CspPipe_partitions_of(pa.p,&m.key,sizeof(m.key)) == pa.index && m.seq == last[m.key] + 1;
+        last[m.key] = m.seq;
+        count++;
+    }
+    if( !ok )
+        count = -1;
+    CspChan_send(pa.result,&count);
+    return 0;
+}
+
+static void testPartitions()
+{
+    enum { parts = 4 };
+    CspPipe_Partitions* p = CspPipe_partitions_create(parts,4,sizeof(keyed_msg));
+    CspChan_t* result = CspChan_create(parts,sizeof(int));
+    partition_arg args[parts];
+    int i, seq, total = 0, ok = 1;
+    for( i = 0; i < parts; i++ )
+    {
+        args[i].p = p;
+        args[i].index = i;
+        args[i].result = result;
+        CspChan_fork(partitionReceiver,&args[i]);
+    }
+    for( seq = 0; seq < 200; seq++ )
+    {
+        for( i = 0; i < 16; i++ )
+        {
+            keyed_msg m;
+            m.key = i;
+            m.seq = seq;
+            CspPipe_partitions_send(p,&m.key,sizeof(m.key),&m);
+        }
+    }
+    for( i = 0; i < parts; i++ )
+    {
+        keyed_msg end;
+        end.key = end.seq = -1;
+        CspChan_send(CspPipe_partitions_channel(p,i),&end);
+    }
+    for( i = 0; i < parts; i++ )
+    {
+        int count;
+        CspChan_receive(result,&count);
+        ok = ok && count >= 0;
+        total += count;
+    }
+    CspPipe_partitions_dispose(p);
+    CspChan_dispose(result);
+    printf("partitions: %s\n", ok && total == 200 * 16 ? "ok" : "error");
+}
+
+typedef struct fanin_arg {
+    CspChan_t* c;
+    int id;
+} fanin_arg;
+
+static void* faninSender(void* arg)
+{
+    fanin_arg fa = *(fanin_arg*)arg;
+    free(arg);
+    keyed_msg m;
+    m.key = fa.id;
+    for( m.seq = 0; m.seq < 1000; m.seq++ )
+        CspChan_send(fa.c,&m);
+    return 0;
+}
+
+static void testSharded()
+{
+    enum { senders = 64 };
+    CspChan_t* c = CspChan_create_ex(256,sizeof(keyed_msg),CspChan_Sharded);
+    CspChan_t* other = CspChan_create(1,sizeof(keyed_msg));
+    int last[senders];
+    int i, ok = 1;
+    for( i = 0; i < senders; i++ )
+    {
+        fanin_arg* fa = (fanin_arg*)malloc(sizeof(fanin_arg));
+        fa->c = c;
+        fa->id = i;
+        last[i] = -1;
+        CspChan_fork(faninSender,fa);
+    }
+    for( i = 0; i < senders * 1000; i++ )
+    {
+        keyed_msg m;
+        if( i % 2 )
+            CspChan_receive(c,&m);
+        else
+        {
+            /* the fan-in channel also works in a select */
+            CspChan_t* receivers[2] = { c, other };
+            void* rData[2] = { &m, &m };
+            ok = ok && CspChan_select(receivers,rData,2,0,0,0) == 0;
+        }
+        ok = ok && m.seq == last[m.key] + 1;
+        last[m.key] = m.seq;
+    }
+    CspChan_dispose(c);
+    CspChan_dispose(other);
+    printf("sharded: %s\n", ok ? "ok" : "error");
+}
+
+static void* batchingSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 1; i <= 1000; i++ )
+    {
+        CspChan_send(c,&i);
+        if( i % 250 == 0 )
+            CspChan_sleep(50); /* longer than the delay, so a partial batch is due */
+    }
+    CspChan_close(c);
+    return 0;
+}
+
+static void testBatching()
+{
+    enum { maxCount = 16 };
+    CspChan_t* in = CspChan_create(0,sizeof(int));
+    CspChan_t* out = CspChan_create(2,CSPPIPE_BATCH_LEN(maxCount,sizeof(int)));
+    CspPipe_Stage* s = CspPipe_batch(in,out,maxCount,10);
+    unsigned char batch[CSPPIPE_BATCH_LEN(maxCount,sizeof(int))];
+    int next = 1, partial = 0, ok = s != 0;
+    CspChan_fork(batchingSender,in);
+    while( ok && next <= 1000 )
+    {
+        CspChan_receive(out,batch);
+        const unsigned int count = *(unsigned int*)batch;
+        const int* msgs = (const int*)(batch + CSPPIPE_BATCH_HEADER);
+        unsigned int i;
+        ok = count > 0 && count <= maxCount;
+        for( i = 0; i < count && ok; i++ )
+            ok = msgs[i] == next++;
+        if( count < maxCount )
+            partial++;
+    }
+    CspPipe_join(s);
+    CspChan_dispose(in);
+    CspChan_dispose(out);
+    /* 1000 is not a multiple of 16, so at least the last batch is partial */
+    printf("batching: %s\n", ok && partial > 0 ? "ok" : "error");
+}
+
+static void* coalescingSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 1; i <= 1000; i++ )
+    {
+        CspChan_send(c,&i);
+        if( i % 100 == 0 )
+            CspChan_sleep(2);
+    }
+    /* a single message must not wait for more to come */
+    CspChan_sleep(20);
+    CspChan_send(c,&i);
+    return 0;
+}
+
+static void* lateSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i = 1;
+    CspChan_sleep(50);
+    CspChan_send(c,&i);
+    return 0;
+}
+
+static void testCoalescing()
+{
+    CspChan_t* c = CspChan_create(64,sizeof(int));
+    CspChan_coalesce(c,16,5);
+    CspChan_fork(coalescingSender,c);
+    int i, x, ok = 1;
+    for( i = 1; i <= 1001 && ok; i++ )
+    {
+        CspChan_receive(c,&x);
+        ok = x == i;
+    }
+    /* the receiver wakes up every 5 ms while it waits, but that is one blocked receive */
+    CspChan_Stats before, after;
+    CspChan_stats(c,&before);
+    CspChan_fork(lateSender,c);
+    CspChan_receive(c,&x);
+    CspChan_stats(c,&after);
+    ok = ok && after.blockedReceives == before.blockedReceives + 1;
+    CspChan_dispose(c);
+    printf("coalescing: %s\n", ok ? "ok" : "error");
+}
+
+enum { ConflateCount = 100000 };
+
+static void* conflatingSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i, msg[3];
+    for( i = 1; i <= ConflateCount; i++ )
+    {
+        msg[0] = i;
+        msg[1] = -i;
+        msg[2] = 2 * i;
+        CspChan_send(c,msg);
+    }
+    return 0;
+}
+
+static void testLossy()
+{
+    CspChan_t* over = CspChan_create_ex(4,sizeof(int),CspChan_OverwriteOldest);
+    CspChan_t* drop = CspChan_create_ex(4,sizeof(int),CspChan_DropNewest);
+    CspChan_Stats so, sd;
+    int i, x, buf[4], ok = 1;
+    for( i = 1; i <= 10; i++ )
+    {
+        CspChan_send(over,&i);
+        CspChan_send(drop,&i);
+    }
+    /* a full lossy channel is still ready for sending */
+    x = 11;
+    void* data = &x;
+    ok = CspChan_nb_select(0,0,0,&drop,&data,1) == 0;
+    ok = ok && CspChan_receive_n(over,buf,4) == 4 && buf[0] == 7 && buf[3] == 10;
+    ok = ok && CspChan_receive_n(drop,buf,4) == 4 && buf[0] == 1 && buf[3] == 4;
+    CspChan_stats(over,&so);
+    CspChan_stats(drop,&sd);
+    ok = ok && so.overwritten == 6 && so.dropped == 0 && sd.dropped == 7 && sd.overwritten == 0;
+    CspChan_dispose(over);
+    CspChan_dispose(drop);
+
+    CspChan_t* c = CspChan_create_ex(8,3*sizeof(int),CspChan_Conflate);
+    int msg[3];
+    ok = ok && CspChan_latest(c,msg) == 0;
+    CspChan_fork(conflatingSender,c);
+    unsigned int version = 0, last = 0, reads = 0;
+    while( ok && version < ConflateCount )
+    {
+        version = CspChan_latest(c,msg);
+        if( version != 0 )
+        {
+            /* the three parts of a message must always be of the same send */
+            ok = version >= last && msg[0] == (int)version && msg[1] == -msg[0] && msg[2] == 2 * msg[0];
+            last = version;
+            reads++;
+        }
+    }
+    ok = ok && CspChan_receive_n(c,msg,1) == 1 && msg[0] == ConflateCount;
+    CspChan_stats(c,&so);
+    ok = ok && so.overwritten > 0;
+    CspChan_dispose(c);
+
+    /* a mirrored ring would have more than the one slot CspChan_latest reads */
+    c = CspChan_create_ex(100,3*sizeof(int),CspChan_Conflate | CspChan_Mirrored);
+    for( i = 1; i <= 5; i++ )
+    {
+        msg[0] = i;
+        CspChan_send(c,msg);
+    }
+    ok = ok && CspChan_latest(c,msg) == 5 && msg[0] == 5;
+    CspChan_dispose(c);
+    printf("lossy: %s\n", ok ? "ok" : "error");
+}
+
+enum { KeyedKeys = 50, KeyedUpdates = 100000 };
+
+typedef struct keyed_update
+{
+    int key;
+    int value;
+} keyed_update;
+
+static void* keyedSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    keyed_update u;
+    int i;
+    for( i = 1; i <= KeyedUpdates; i++ )
+    {
+        u.key = (i * 7919) % KeyedKeys;
+        u.value = i;
+        CspChan_send(c,&u);
+    }
+    u.key = -1;
+    CspChan_send(c,&u);
+    return 0;
+}
+
+static void testKeyed()
+{
+    CspChan_t* c = CspChan_create_keyed(8,sizeof(keyed_update),sizeof(int));
+    keyed_update u, got[8];
+    CspChan_Stats st;
+    int i, ok = 1;
+    for( i = 1; i <= 8; i++ )
+    {
+        u.key = i;
+        u.value = 0;
+        CspChan_send(c,&u);
+    }
+    /* the channel is full, but not for a pending key */
+    u.key = 3;
+    u.value = 1;
+    void* data = &u;
+    ok = CspChan_nb_select(0,0,0,&c,&data,1) == 0;
+    u.key = 9;
+    ok = ok && CspChan_nb_select(0,0,0,&c,&data,1) == -1;
+    u.key = 1;
+    u.value = 2;
+    CspChan_send(c,&u);
+    ok = ok && CspChan_receive_n(c,got,8) == 8;
+    ok = ok && got[0].key == 1 && got[0].value == 2 && got[2].key == 3 && got[2].value == 1 && got[7].key == 8;
+    CspChan_stats(c,&st);
+    ok = ok && st.replaced == 2;
+
+    /* more keys than fit the channel; each key must only ever see newer values */
+    int last[KeyedKeys];
+    memset(last,0,sizeof(last));
+    CspChan_fork(keyedSender,c);
+    unsigned int received = 0;
+    while( ok )
+    {
+        CspChan_receive(c,&u);
+        if( u.key < 0 )
+            break;
+        ok = u.key < KeyedKeys && u.value > last[u.key];
+        last[u.key] = u.value;
+        received++;
+    }
+    for( i = KeyedUpdates - KeyedKeys + 1; i <= KeyedUpdates && ok; i++ )
+        ok = last[(i * 7919) % KeyedKeys] == i;
+    CspChan_stats(c,&st);
+    ok = ok && received + st.replaced == KeyedUpdates + 2;
+    CspChan_dispose(c);
+    printf("keyed: %s\n", ok ? "ok" : "error");
+}
+
+enum { PriorityLevels = 5, PriorityCount = 10000 };
+
+typedef struct prio_job
+{
+    int prio;
+    int seq;
+} prio_job;
+
+static void* prioritySender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    prio_job j;
+    for( j.seq = 0; j.seq < PriorityCount; j.seq++ )
+    {
+        j.prio = rand() % PriorityLevels;
+        CspChan_send(c,&j);
+    }
+    j.prio = -1; /* the lowest priority, so it comes last */
+    CspChan_send(c,&j);
+    return 0;
+}
+
+static void testPriority()
+{
+    CspChan_t* c = CspChan_create_priority(64,sizeof(prio_job));
+    prio_job j, prev;
+    int i, ok = 1;
+    for( i = 0; i < 64; i++ )
+    {
+        j.prio = (i * 3) % PriorityLevels;
+        j.seq = i;
+        CspChan_send(c,&j);
+    }
+    void* data = &j;
+    ok = CspChan_nb_select(&c,&data,1,0,0,0) == 0 && j.prio == PriorityLevels - 1;
+    prev = j;
+    for( i = 1; i < 64 && ok; i++ )
+    {
+        CspChan_receive(c,&j);
+        /* highest priority first, first in first out among equal priorities */
+        ok = j.prio < prev.prio || (j.prio == prev.prio && j.seq > prev.seq);
+        prev = j;
+    }
+
+    int last[PriorityLevels];
+    for( i = 0; i < PriorityLevels; i++ )
+        last[i] = -1;
+    CspChan_fork(prioritySender,c);
+    int received = 0;
+    while( ok )
+    {
+        CspChan_receive(c,&j);
+        if( j.prio < 0 )
+            break;
+        ok = j.prio < PriorityLevels && j.seq > last[j.prio];
+        last[j.prio] = j.seq;
+        received++;
+    }
+    ok = ok && received == PriorityCount;
+    CspChan_dispose(c);
+    printf("priority: %s\n", ok ? "ok" : "error");
+}
+
+enum { DelayedCount = 50000 };
+
+static void testDelayed()
+{
+    CspChan_t* c = CspChan_create_delayed(DelayedCount,sizeof(int));
+    int x, ok = 1;
+    x = 1;
+    CspChan_send_delayed(c,&x,300);
+    x = 2;
+    CspChan_send_delayed(c,&x,100);
+    x = 3;
+    CspChan_send(c,&x);
+    void* data = &x;
+    ok = CspChan_nb_select(&c,&data,1,0,0,0) == 0 && x == 3;
+    ok = ok && CspChan_nb_select(&c,&data,1,0,0,0) == -1;
+    ok = ok && CspChan_timed_select(&c,&data,1,0,0,0,20) == -1;
+    /* select and receive wait until the next message is due */
+    ok = ok && CspChan_select(&c,&data,1,0,0,0) == 0 && x == 2;
+    CspChan_receive(c,&x);
+    ok = ok && x == 1;
+
+    /* many pending messages, but no thread waiting for any of them */
+    int i, buf[256];
+    long long sum = 0;
+    for( i = 0; i < DelayedCount; i++ )
+        CspChan_send_delayed(c,&i,50 + (i * 7919) % 100);
+    int received = 0;
+    while( received < DelayedCount )
+    {
+        const unsigned int n = CspChan_receive_n(c,buf,256);
+        for( i = 0; i < n; i++ )
+            sum += buf[i];
+        received += n;
+    }
+    ok = ok && sum == (long long)DelayedCount * (DelayedCount - 1) / 2;
+    CspChan_dispose(c);
+    printf("delayed: %s\n", ok ? "ok" : "error");
+}
+
+enum { AqmCount = 3000 };
+
+static void* aqmSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 0; i < AqmCount; i++ )
+        CspChan_send(c,&i);
+    i = -1;
+    CspChan_send(c,&i);
+    return 0;
+}
+
+static void testAqm()
+{
+    CspChan_t* c = CspChan_create(256,sizeof(int));
+    CspChan_t* divert = CspChan_create(AqmCount,sizeof(int));
+    CspChan_aqm(c,5000,20000,divert);
+    CspChan_fork(aqmSender,c);
+    int x, last = -1, received = 0, ok = 1;
+    while( ok )
+    {
+        CspChan_receive(c,&x);
+        if( x < 0 )
+            break;
+        /* the receiver is slower than the sender, so the channel fills up */
+        if( received++ % 4 == 0 )
+            CspChan_sleep(1);
+        ok = x > last;
+        last = x;
+    }
+    CspChan_Stats st;
+    CspChan_stats(c,&st);
+    int diverted = 0;
+    void* data = &x;
+    while( CspChan_nb_select(&divert,&data,1,0,0,0) == 0 )
+        diverted++;
+    ok = ok && st.diverted > 0 && st.diverted == diverted && received + st.diverted + st.shed == AqmCount;
+    CspChan_dispose(c);
+    CspChan_dispose(divert);
+
+    /* the ring of a mirrored channel has more slots than queueLen, and each has a send time */
+    int msg[3], i;
+    c = CspChan_create_ex(100,sizeof(msg),CspChan_Mirrored);
+    CspChan_aqm(c,5000,20000,0);
+    for( i = 0; i < 3000 && ok; i++ )
+    {
+        msg[0] = i;
+        CspChan_send(c,msg);
+        CspChan_receive(c,msg);
+        ok = msg[0] == i;
+    }
+    CspChan_dispose(c);
+    printf("aqm: %s\n", ok ? "ok" : "error");
+}
+
+enum { ParksRun = 10, ParksCount = 100 };
+
+typedef struct parks_arg
+{
+    CspChan_t* a;
+    CspChan_t* b;
+    int viaSelect; /* the producer sends to a with CspChan_select */
+} parks_arg;
+
+static void* parksProducer(void* arg)
+{
+    /* ParksRun messages on a for every one on b, so a needs a buffer of ParksRun */
+    parks_arg* p = (parks_arg*)arg;
+    int i;
+    for( i = 0; i < ParksCount; i++ )
+    {
+        void* data = &i;
+        if( i % ParksRun == ParksRun - 1 )
+            CspChan_send(p->b,&i);
+        else if( p->viaSelect )
+            CspChan_select(0,0,0,&p->a,&data,1);
+        else
+            CspChan_send(p->a,&i);
+    }
+    return 0;
+}
+
+static void noJob(CspChan_Job* j)
+{
+}
+
+static void testParks()
+{
+    CspChan_resolve_deadlocks(1);
+    /* a worker of the pool, which never blocks in a channel, must not count as an agent */
+    CspChan_Job job;
+    job.run = noJob;
+    CspChan_post(&job);
+    parks_arg p;
+    int i, j, x, ok = 1;
+    for( p.viaSelect = 0; p.viaSelect <= 1 && ok; p.viaSelect++ )
+    {
+        p.a = CspChan_create(1,sizeof(int));
+        p.b = CspChan_create(1,sizeof(int));
+        CspChan_fork(parksProducer,&p);
+        for( i = 0; i < ParksCount / ParksRun && ok; i++ )
+        {
+            /* the consumer wants the message on b first, which the producer only sends after filling a */
+            CspChan_receive(p.b,&x);
+            ok = x == i * ParksRun + ParksRun - 1;
+            for( j = 0; j < ParksRun - 1 && ok; j++ )
+            {
+                CspChan_receive(p.a,&x);
+                ok = x == i * ParksRun + j;
+            }
+        }
+        CspChan_Stats st;
+        CspChan_stats(p.a,&st);
+        ok = ok && st.grown >= 4; /* 1, 2, 4, 8, 16 */
+        CspChan_stats(p.b,&st);
+        ok = ok && st.grown == 0;
+        CspChan_dispose(p.a);
+        CspChan_dispose(p.b);
+    }
+    CspChan_resolve_deadlocks(0);
+    printf("parks: %s\n", ok ? "ok" : "error");
+}
+
+enum { TuneCount = 5000, TuneCalmCount = 2000 };
+
+static void* tunedSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 0; i < TuneCount; i++ )
+        CspChan_send(c,&i); /* as fast as possible */
+    for( i = 0; i < TuneCalmCount; i++ )
+    {
+        if( i % 50 == 0 )
+            CspChan_sleep(1); /* now the receiver is faster */
+        CspChan_send(c,&i);
+    }
+    return 0;
+}
+
+enum { TuneWindowLen = 256, TuneTrickle = 200, TuneRounds = 2 };
+
+static void* trickleSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 0; i < TuneRounds * TuneWindowLen; i++ )
+    {
+        if( i % TuneWindowLen < TuneTrickle )
+            CspChan_sleep(1); /* the receiver waits */
+        CspChan_send(c,&i);
+    }
+    return 0;
+}
+
+static void testAutotune()
+{
+    CspChan_t* c = CspChan_create(4,sizeof(int));
+    CspChan_autotune(c,4,1024,10);
+    CspChan_fork(tunedSender,c);
+    int i, x, ok = 1;
+    for( i = 0; i < TuneCount && ok; i++ )
+    {
+        /* the receiver takes a break now and then, so the sender blocks unless the channel is large enough */
+        if( i % 64 == 0 )
+            CspChan_sleep(1);
+        CspChan_receive(c,&x);
+        ok = x == i;
+    }
+    CspChan_Stats busy, calm;
+    CspChan_stats(c,&busy);
+    ok = ok && busy.tunedUp > 0 && busy.queueLen > 4 && busy.blockedSends > 0;
+    for( i = 0; i < TuneCalmCount && ok; i++ )
+    {
+        CspChan_receive(c,&x);
+        ok = x == i;
+    }
+    CspChan_stats(c,&calm);
+    ok = ok && calm.tunedDown > 0 && calm.queueLen < busy.queueLen && calm.blockedReceives > busy.blockedReceives;
+    CspChan_dispose(c);
+
+    /* mostly a trickle the receiver waits for, with a burst which fills most of the channel; the channel
+       shrinks nevertheless */
+    c = CspChan_create(64,sizeof(int));
+    CspChan_autotune(c,4,1024,10);
+    CspChan_fork(trickleSender,c);
+    for( i = 0; i < TuneRounds * TuneWindowLen && ok; i++ )
+    {
+        CspChan_receive(c,&x);
+        ok = x == i;
+        if( i % TuneWindowLen == TuneTrickle )
+            CspChan_sleep(5); /* so the burst piles up */
+    }
+    CspChan_stats(c,&calm);
+    ok = ok && calm.tunedDown > 0 && calm.tunedUp == 0;
+    CspChan_dispose(c);
+    printf("autotune: %s\n", ok ? "ok" : "error");
+}
+
+enum { ResizeCount = 100 };
+
+static void* resizeSender(void* arg)
+{
+    CspChan_t* c = (CspChan_t*)arg;
+    int i;
+    for( i = 0; i < ResizeCount; i++ )
+        CspChan_send(c,&i);
+    return 0;
+}
+
+static void testResize()
+{
+    CspChan_t* c = CspChan_create(4,sizeof(int));
+    int i, x, ok = 1;
+    /* the ring buffer wraps around before resizing */
+    for( i = 0; i < 3; i++ )
+        CspChan_send(c,&i);
+    for( i = 0; i < 3; i++ )
+        CspChan_receive(c,&x);
+    CspChan_fork(resizeSender,c);
+    CspChan_sleep(20);
+    /* the sender is blocked on the full channel; resizing lets it continue */
+    ok = CspChan_resize(c,64);
+    CspChan_sleep(20);
+    x = -1;
+    void* data = &x;
+    ok = ok && CspChan_nb_select(0,0,0,&c,&data,1) == -1;
+    ok = ok && !CspChan_resize(c,32); /* less than buffered */
+    for( i = 0; i < ResizeCount && ok; i++ )
+    {
+        CspChan_receive(c,&x);
+        ok = x == i;
+    }
+    ok = ok && CspChan_resize(c,8);
+    CspChan_Stats st;
+    CspChan_stats(c,&st);
+    ok = ok && st.queueLen == 8;
+    CspChan_dispose(c);
+    printf("resize: %s\n", ok ? "ok" : "error");
+}
+
+enum { MergeCount = 2000 };
+
+typedef struct merge_arg {
+    CspChan_t* out;
+    int first, step;
+} merge_arg;
+
+static void* mergeSender(void* arg)
+{
+    merge_arg* a = (merge_arg*)arg;
+    int i;
+    for( i = a->first; i < MergeCount; i += a->step )
+        CspChan_send(a->out,&i);
+    CspChan_close(a->out); /* unbuffered, so nothing is lost */
+    return 0;
+}
+
+static int compareInts(void* ctx, const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+static void testMerge()
+{
+    CspChan_t* in[3];
+    CspChan_t* out = CspChan_create(16,sizeof(int));
+    /* the multiples of three, all numbers from 1, and an input without messages */
+    merge_arg args[3] = { { 0, 0, 3 }, { 0, 1, 1 }, { 0, MergeCount, 1 } };
+    int i, x, ok;
+    for( i = 0; i < 3; i++ )
+        args[i].out = in[i] = CspChan_create(0,sizeof(int));
+    CspPipe_Stage* s = CspPipe_merge(in,3,out,8,compareInts,0);
+    ok = s != 0;
+    for( i = 0; i < 3; i++ )
+        CspChan_fork(mergeSender,&args[i]);
+    /* the multiples of three come twice, from the first input first */
+    for( i = 0; i < MergeCount && ok; i++ )
+    {
+        CspChan_receive(out,&x);
+        ok = x == i;
+        if( ok && i % 3 == 0 && i != 0 )
+        {
+            CspChan_receive(out,&x);
+            ok = x == i;
+        }
+    }
+    CspPipe_join(s);
+    void* data = &x;
+    ok = ok && CspChan_nb_select(&out,&data,1,0,0,0) == -1; /* nothing more */
+    for( i = 0; i < 3; i++ )
+        CspChan_dispose(in[i]);
+    CspChan_dispose(out);
+    printf("merge: %s\n", ok ? "ok" : "error");
+}
+
+typedef struct window_arg {
+    CspChan_t* left;
+    CspChan_t* right;
+} window_arg;
+
+static void windowSend(CspChan_t* c, int key, int value)
+{
+    int msg[2];
+    msg[0] = key;
+    msg[1] = value + key;
+    CspChan_send(c,msg);
+}
+
+static void* windowSender(void* arg)
+{
+    /* the channels are unbuffered, so the stage receives in this order */
+    window_arg* a = (window_arg*)arg;
+    int i;
+    for( i = 1; i <= 3; i++ )
+        windowSend(a->left,i,100);
+    windowSend(a->right,2,200);
+    windowSend(a->right,1,200);
+    CspChan_sleep(200); /* left 3 expires */
+    windowSend(a->right,3,200);
+    windowSend(a->left,3,100);
+    for( i = 10; i <= 14; i++ )
+        windowSend(a->left,i,100); /* 10 overflows */
+    windowSend(a->right,12,200);
+    CspChan_close(a->left);
+    CspChan_close(a->right);
+    return 0;
+}
+
+static void testWindowJoin()
+{
+    CspChan_simulate(1);
+    window_arg a;
+    a.left = CspChan_create(0,2*sizeof(int));
+    a.right = CspChan_create(0,2*sizeof(int));
+    CspChan_t* out = CspChan_create(8,CSPPIPE_JOIN_LEN(2*sizeof(int),2*sizeof(int)));
+    CspPipe_WindowStats st;
+    CspPipe_Stage* s = CspPipe_window_join(a.left,a.right,out,0,sizeof(int),100,4,&st);
+    const int keys[] = { 2, 1, 3, 12 };
+    int pair[4], i, ok = s != 0;
+    CspChan_fork(windowSender,&a);
+    for( i = 0; i < 4 && ok; i++ )
+    {
+        CspChan_receive(out,pair);
+        ok = pair[0] == keys[i] && pair[1] == 100 + keys[i] && pair[2] == keys[i] && pair[3] == 200 + keys[i];
+    }
+    CspPipe_join(s);
+    ok = ok && st.joined == 4 && st.expired == 1 && st.overflowed == 1 && st.unmatched == 3;
+    CspChan_simulate(0);
+    CspChan_dispose(a.left);
+    CspChan_dispose(a.right);
+    CspChan_dispose(out);
+    printf("window join: %s\n", ok ? "ok" : "error");
+}
+
+typedef struct sim_arg {
+    CspChan_t* out;
+    int id;
+    unsigned int ms;
+} sim_arg;
+
+static void* simSleeper(void* arg)
+{
+    sim_arg* a = (sim_arg*)arg;
+    CspChan_sleep(a->ms);
+    CspChan_send(a->out,&a->id);
+    return 0;
+}
+
+static void testSimulation()
+{
+    CspChan_simulate(1);
+    const time_t started = time(NULL);
+    const double start = CspChan_now();
+    CspChan_t* c = CspChan_create(2,sizeof(int));
+    sim_arg slow = { c, 1, 3000 };
+    sim_arg fast = { c, 2, 1000 };
+    CspChan_fork(simSleeper,&slow);
+    CspChan_fork(simSleeper,&fast);
+    int x, ok;
+    CspChan_receive(c,&x);
+    ok = x == 2 && CspChan_now() - start >= 1000;
+    CspChan_receive(c,&x);
+    ok = ok && x == 1 && CspChan_now() - start >= 3000;
+    void* data = &x;
+    ok = ok && CspChan_timed_select(&c,&data,1,0,0,0,5000) == -1; /* nobody sends anymore */
+    ok = ok && CspChan_now() - start >= 8000;
+    ok = ok && time(NULL) - started < 3; /* instead of eight seconds */
+    CspChan_simulate(0);
+    CspChan_dispose(c);
+    printf("simulation: %s\n", ok ? "ok" : "error");
+}
+
 int main(int argc, char *argv[])
 {
     pthread_mutex_init(&mtx,0);
@@ -561,6 +1819,31 @@ int main(int argc, char *argv[])
     testSieve2();
     printf("tc=%d\n", threadcount);fflush(stdout);
 #endif
+#if 1
+    testHugePages();
+    testBatch();
+    testCompact();
+    testLazy();
+    testLargeMessages();
+    testAsync();
+    testFusion();
+    testParallelMap();
+    testPartitions();
+    testSharded();
+    testBatching();
+    testCoalescing();
+    testLossy();
+    testKeyed();
+    testPriority();
+    testDelayed();
+    testAqm();
+    testParks();
+    testAutotune();
+    testResize();
+    testSimulation();
+    testMerge();
+    testWindowJoin();
+#endif
 #if 1
     testSelect();
 #endif
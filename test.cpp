@@ -0,0 +1,167 @@
+/*
+* Copyright 2023 Rochus Keller <mailto:me@rochus-keller.ch>
+*
+* This file may be used under the terms of the GNU Lesser
+* General Public License version 2.1 or version 3 as published by the Free
+* Software Foundation and appearing in the file LICENSE.LGPLv21 and
+* LICENSE.LGPLv3 included in the packaging of this file. Please review the
+* following information to ensure the GNU Lesser General Public License
+* requirements will be met: https://www.gnu.org/licenses/lgpl.html and
+* http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+*
+* Alternatively this file may be used under the terms of the Mozilla
+* Public License. If a copy of the MPL was not distributed with this
+* file, You can obtain one at https://mozilla.org/MPL/2.0/.
+*/
+
+#include "CspChan.hpp"
+#include <stdio.h>
+#include <string>
+#include <thread>
+
+static void testChan()
+{
+    Csp::Chan<int,4> c;
+    std::thread sender([&c]()
+    {
+        for( int i = 0; i < 100; i++ )
+            c.send(i);
+        c.send(-1);
+    });
+    bool ok = true;
+    int x;
+    for( int i = 0; i < 100 && ok; i++ )
+        ok = c.recv(x) && x == i;
+    ok = ok && c.recv() == -1;
+    sender.join();
+    c.close();
+    ok = ok && c.closed() && !c.recv(x);
+    printf("chan: %s\n", ok ? "ok" : "error");
+}
+
+struct Tracked
+{
+    static int live;
+    std::string s;
+    Tracked() { live++; }
+    Tracked(const std::string& v):s(v) { live++; }
+    Tracked(const Tracked& o):s(o.s) { live++; }
+    Tracked(Tracked&& o):s(std::move(o.s)) { live++; }
+    Tracked& operator=(const Tracked&) = default;
+    Tracked& operator=(Tracked&&) = default;
+    ~Tracked() { live--; }
+};
+int Tracked::live = 0;
+
+static void testBoxed()
+{
+    bool ok = true;
+    {
+        Csp::Chan<std::string> c; /* unbuffered */
+        std::thread sender([&c]()
+        {
+            for( int i = 0; i < 50; i++ )
+                c.send(std::string(100, 'a' + i % 26)); /* too long for the small string buffer */
+        });
+        std::string s;
+        for( int i = 0; i < 50 && ok; i++ )
+            ok = c.recv(s) && s == std::string(100, 'a' + i % 26);
+        sender.join();
+    }
+    {
+        Csp::Chan<Tracked,4> c;
+        c.send(Tracked("a"));
+        c.send(Tracked("b"));
+        c.send(Tracked("c"));
+        Tracked t;
+        ok = ok && c.recv(t) && t.s == "a";
+        /* b and c are lost by closing; their boxes are deleted with the channel */
+        c.close();
+        ok = ok && !c.recv(t) && Tracked::live == 3;
+    }
+    ok = ok && Tracked::live == 0;
+    printf("boxed: %s\n", ok ? "ok" : "error");
+}
+
+static void testSelect()
+{
+    Csp::Chan<int> a; /* unbuffered, nobody sends */
+    Csp::Chan<int,1> b; /* room for one */
+    Csp::Chan<int,1> full;
+    Csp::Chan<std::string,1> fullBoxed;
+    full.send(1);
+    fullBoxed.send(std::string("x"));
+    int x = 0, y = 0;
+    bool ok = Csp::nb_select(Csp::recv(a, x), Csp::send(full, 5), Csp::send(fullBoxed, std::string("y")),
+                             Csp::send(b, 7)) == 3;
+    ok = ok && Csp::nb_select(Csp::recv(a, x), Csp::send(full, 5), Csp::send(fullBoxed, std::string("y"))) == -1;
+    ok = ok && Csp::nb_select(Csp::send(full, 5), Csp::recv(a, x), Csp::recv(b, y)) == 2 && y == 7;
+    std::thread sender([&a]() { a.send(42); });
+    ok = ok && Csp::select(Csp::send(full, 5), Csp::recv(a, x)) == 1 && x == 42;
+    sender.join();
+    std::string s;
+    ok = ok && Csp::select(Csp::recv(fullBoxed, s), Csp::recv(a, x)) == 0 && s == "x";
+    printf("select: %s\n", ok ? "ok" : "error");
+}
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+#include <exception>
+
+/* a coroutine which starts at once and frees its frame when it ends */
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return Task(); }
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static Task consumer(Csp::Chan<int>& in, Csp::Chan<int>& other, Csp::Chan<std::string,1>& out, Csp::Chan<int,1>& result)
+{
+    bool ok = true;
+    int x = 0, y = 0;
+    for( int i = 0; i < 10 && ok; i++ )
+        ok = co_await Csp::recv(in, x) && x == i;
+    ok = ok && co_await Csp::send(out, std::string(100, 'h')); /* boxed */
+    ok = ok && co_await Csp::async_select(Csp::recv(in, x), Csp::recv(other, y)) == 1 && y == 7;
+    ok = ok && !co_await Csp::recv(in, x); /* closed */
+    result.send(ok ? 1 : 0); /* buffered, so this doesn't block the pool thread */
+}
+
+static void testCoroutines()
+{
+    /* the coroutine is suspended in the channels and resumed on the pool; its peer is a thread */
+    Csp::Chan<int> in, other;
+    Csp::Chan<std::string,1> out;
+    Csp::Chan<int,1> result;
+    bool peerOk = true;
+    std::thread peer([&]()
+    {
+        for( int i = 0; i < 10; i++ )
+            in.send(i);
+        std::string s;
+        peerOk = out.recv(s) && s == std::string(100, 'h');
+        other.send(7);
+        in.close();
+    });
+    consumer(in, other, out, result);
+    const bool ok = result.recv() == 1;
+    peer.join();
+    printf("coroutines: %s\n", ok && peerOk ? "ok" : "error");
+}
+#endif
+
+int main()
+{
+    testChan();
+    testBoxed();
+    testSelect();
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+    testCoroutines();
+#endif
+    return 0;
+}
@@ -0,0 +1,19 @@
+QT       -= core
+QT       -= gui
+
+TARGET = test_cpp
+CONFIG   += console c++2a
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+QMAKE_CFLAGS += -std=c89
+LIBS += -lpthread
+
+SOURCES += \
+    CspChan.c \
+    test.cpp
+
+HEADERS += \
+    CspChan.h \
+    CspChan.hpp